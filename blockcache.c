@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "blockcache.h"
+
+#define BLOCKCACHE_MAGIC "CFBC1 "
+#define BLOCKCACHE_BUCKETS 65536
+#define VERSION_INDEX -1
+
+/*
+ * Each cached chunk is a file named <path hash><version hash>.<index>
+ * holding a header with the full path and version, checked on every
+ * read so that a hash collision is only a miss, followed by the chunk
+ * as it was downloaded. The last version seen of an object is a file of
+ * the same form named .version with no data; it is kept and evicted
+ * like a chunk.
+ */
+typedef struct cache_entry {
+  uint64_t path_hash;
+  uint64_t version_hash;
+  int index;
+  size_t size;
+  time_t used;
+  struct cache_entry *next;
+  struct cache_entry *newer, *older;
+} t_cache_entry;
+
+static t_cache_entry **buckets = NULL;
+static t_cache_entry *newest = NULL, *oldest = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t used_bytes = 0;
+static size_t entries = 0;
+static size_t hits = 0;
+static size_t misses = 0;
+static size_t stores = 0;
+static size_t evictions = 0;
+static size_t revalidated = 0;
+static size_t changed = 0;
+
+static uint64_t hash_string(const char *s) {
+  uint64_t hash = 14695981039346656037ULL;
+  while(*s) {
+    hash ^= (unsigned char)*s++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static t_cache_entry ** bucket_for(uint64_t path_hash, int index) {
+  uint64_t hash = path_hash ^ ((uint64_t)(index + 1) * 0x9e3779b97f4a7c15ULL);
+  return &buckets[hash % BLOCKCACHE_BUCKETS];
+}
+
+static void entry_name(char *name, uint64_t path_hash, uint64_t version_hash, int index) {
+  if(index == VERSION_INDEX)
+    snprintf(name, PATH_MAX, "%s/%016llx%016llx.version", CACHE_DIR,
+             (unsigned long long)path_hash, (unsigned long long)version_hash);
+  else
+    snprintf(name, PATH_MAX, "%s/%016llx%016llx.%d", CACHE_DIR,
+             (unsigned long long)path_hash, (unsigned long long)version_hash, index);
+}
+
+static t_cache_entry * find_entry(uint64_t path_hash, int index) {
+  t_cache_entry *entry;
+  for(entry = *bucket_for(path_hash, index); entry; entry = entry->next)
+    if(entry->path_hash == path_hash && entry->index == index)
+      return entry;
+  return NULL;
+}
+
+static void unlink_lru(t_cache_entry *entry) {
+  if(entry->newer)
+    entry->newer->older = entry->older;
+  else
+    newest = entry->older;
+  if(entry->older)
+    entry->older->newer = entry->newer;
+  else
+    oldest = entry->newer;
+}
+
+static void push_newest(t_cache_entry *entry) {
+  entry->newer = NULL;
+  entry->older = newest;
+  if(newest)
+    newest->newer = entry;
+  else
+    oldest = entry;
+  newest = entry;
+}
+
+static void insert_entry(t_cache_entry *entry) {
+  t_cache_entry **bucket = bucket_for(entry->path_hash, entry->index);
+  entry->next = *bucket;
+  *bucket = entry;
+  push_newest(entry);
+  used_bytes += entry->size;
+  entries++;
+}
+
+static void remove_entry(t_cache_entry *entry) {
+  char name[PATH_MAX];
+  t_cache_entry **link = bucket_for(entry->path_hash, entry->index);
+  while(*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+  unlink_lru(entry);
+  used_bytes -= entry->size;
+  entries--;
+  entry_name(name, entry->path_hash, entry->version_hash, entry->index);
+  unlink(name);
+  free(entry);
+}
+
+static void evict_for(size_t size) {
+  while(oldest && used_bytes + size > CACHE_BYTES) {
+    remove_entry(oldest);
+    evictions++;
+  }
+}
+
+/* Checks that fp holds an entry for path and reads its version. */
+static int read_header(FILE *fp, const char *path, char *version, size_t size) {
+  size_t path_len, version_len;
+  if(fscanf(fp, BLOCKCACHE_MAGIC "%zu %zu", &path_len, &version_len) != 2 ||
+     fgetc(fp) != '\n' || path_len != strlen(path) || version_len >= size)
+    return 0;
+  char *stored = (char*) malloc(path_len + 1);
+  int ok = fread(stored, 1, path_len, fp) == path_len &&
+           !memcmp(stored, path, path_len) &&
+           fread(version, 1, version_len, fp) == version_len;
+  free(stored);
+  version[version_len] = '\0';
+  return ok;
+}
+
+static int compare_used(const void *a, const void *b) {
+  time_t x = (*(t_cache_entry* const*)a)->used;
+  time_t y = (*(t_cache_entry* const*)b)->used;
+  return x < y ? -1 : x > y;
+}
+
+/* Indexes what an earlier mount left in CACHE_DIR, oldest first by
+   modification time, which every hit refreshes. */
+void blockcache_init() {
+  struct dirent *ent;
+  t_cache_entry **found = NULL;
+  size_t count = 0, allocated = 0, i;
+  char name[PATH_MAX];
+  if(!CACHE_DIR)
+    return;
+  DIR *dir = opendir(CACHE_DIR);
+  if(!dir)
+    return;
+  buckets = (t_cache_entry**) calloc(BLOCKCACHE_BUCKETS, sizeof(t_cache_entry*));
+  while((ent = readdir(dir))) {
+    unsigned long long path_hash, version_hash;
+    char *ext, *end;
+    struct stat st;
+    snprintf(name, sizeof(name), "%s/%s", CACHE_DIR, ent->d_name);
+    if(!strncmp(ent->d_name, "tmp", 3)) {
+      unlink(name);
+      continue;
+    }
+    if(strlen(ent->d_name) < 34 || ent->d_name[32] != '.' ||
+       sscanf(ent->d_name, "%16llx%16llx", &path_hash, &version_hash) != 2 ||
+       stat(name, &st) || !S_ISREG(st.st_mode))
+      continue;
+    ext = ent->d_name + 33;
+    long index = strcmp(ext, "version") ? strtol(ext, &end, 10) : VERSION_INDEX;
+    if(index != VERSION_INDEX && (*end || index < 0 || index > INT_MAX))
+      continue;
+    if(count == allocated) {
+      allocated = allocated ? allocated * 2 : 1024;
+      found = (t_cache_entry**) realloc(found, allocated * sizeof(t_cache_entry*));
+    }
+    t_cache_entry *entry = (t_cache_entry*) calloc(1, sizeof(t_cache_entry));
+    entry->path_hash = path_hash;
+    entry->version_hash = version_hash;
+    entry->index = (int)index;
+    entry->size = st.st_size;
+    entry->used = st.st_mtime;
+    found[count++] = entry;
+  }
+  closedir(dir);
+
+  qsort(found, count, sizeof(t_cache_entry*), compare_used);
+  pthread_mutex_lock(&cache_lock);
+  for(i = 0; i < count; i++) {
+    /* only the latest version of a chunk is kept */
+    t_cache_entry *stale = find_entry(found[i]->path_hash, found[i]->index);
+    if(stale)
+      remove_entry(stale);
+    insert_entry(found[i]);
+  }
+  evict_for(0);
+  pthread_mutex_unlock(&cache_lock);
+  free(found);
+}
+
+int blockcache_enabled() {
+  return buckets != NULL;
+}
+
+/* Finds the entry for (path, index), of the given version unless
+   version_hash is 0, and marks it as just used. Returns 0 if there is
+   none. */
+static int use_entry(uint64_t path_hash, uint64_t version_hash, int index, char *name) {
+  pthread_mutex_lock(&cache_lock);
+  t_cache_entry *entry = find_entry(path_hash, index);
+  if(entry && version_hash && entry->version_hash != version_hash)
+    entry = NULL;
+  if(entry) {
+    unlink_lru(entry);
+    push_newest(entry);
+    entry_name(name, entry->path_hash, entry->version_hash, entry->index);
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if(entry)
+    utimensat(AT_FDCWD, name, NULL, 0);
+  return entry != NULL;
+}
+
+/* Reads the last version stored for path, to be revalidated. */
+int blockcache_known_version(const char *path, char *version, size_t size) {
+  char name[PATH_MAX];
+  if(!buckets || !use_entry(hash_string(path), 0, VERSION_INDEX, name))
+    return 0;
+  FILE *fp = fopen(name, "r");
+  int ok = fp && read_header(fp, path, version, size);
+  if(fp)
+    fclose(fp);
+  return ok;
+}
+
+/* Records version as the current one of path. unchanged says whether it
+   matches the version seen last. */
+void blockcache_set_version(const char *path, const char *version, int unchanged) {
+  char name[PATH_MAX];
+  if(!buckets)
+    return;
+  pthread_mutex_lock(&cache_lock);
+  if(unchanged)
+    revalidated++;
+  else
+    changed++;
+  pthread_mutex_unlock(&cache_lock);
+  if(!unchanged || !use_entry(hash_string(path), hash_string(version), VERSION_INDEX, name))
+    blockcache_put(path, version, VERSION_INDEX, NULL, 0);
+}
+
+/* Copies chunk index of version of path into data. Returns 0 on a miss,
+   including an entry that turns out unreadable, which is dropped. */
+int blockcache_get(const char *path, const char *version, int index,
+                   char *data, size_t capacity, size_t *size) {
+  char name[PATH_MAX], stored[BLOCKCACHE_VERSION_SIZE];
+  uint64_t path_hash = hash_string(path), version_hash = hash_string(version);
+  int ok = 0;
+  if(!buckets)
+    return 0;
+  FILE *fp = use_entry(path_hash, version_hash, index, name) ? fopen(name, "r") : NULL;
+  if(fp && read_header(fp, path, stored, sizeof(stored)) && !strcmp(stored, version)) {
+    *size = fread(data, 1, capacity, fp);
+    ok = !ferror(fp) && fgetc(fp) == EOF;
+  }
+  if(fp)
+    fclose(fp);
+  pthread_mutex_lock(&cache_lock);
+  if(ok)
+    hits++;
+  else
+    misses++;
+  pthread_mutex_unlock(&cache_lock);
+  if(fp && !ok)
+    blockcache_drop(path, version, index);
+  return ok;
+}
+
+/* Stores chunk index of version of path, replacing any other version of
+   it. The file is written aside and renamed into place, so readers
+   never see it half written. */
+void blockcache_put(const char *path, const char *version, int index,
+                    const char *data, size_t size) {
+  char name[PATH_MAX], tmp_name[PATH_MAX];
+  uint64_t path_hash = hash_string(path), version_hash = hash_string(version);
+  if(!buckets || strlen(version) >= BLOCKCACHE_VERSION_SIZE)
+    return;
+  snprintf(tmp_name, sizeof(tmp_name), "%s/tmpXXXXXX", CACHE_DIR);
+  int fd = mkstemp(tmp_name);
+  if(fd < 0)
+    return;
+  FILE *fp = fdopen(fd, "w");
+  if(!fp) {
+    close(fd);
+    unlink(tmp_name);
+    return;
+  }
+  fprintf(fp, BLOCKCACHE_MAGIC "%zu %zu\n%s%s", strlen(path), strlen(version),
+          path, version);
+  if(size)
+    fwrite(data, 1, size, fp);
+  long total = ftell(fp);
+  int ok = !fflush(fp) && !ferror(fp) && total > 0;
+  fclose(fp);
+  if(!ok || (size_t)total > CACHE_BYTES) {
+    unlink(tmp_name);
+    return;
+  }
+
+  entry_name(name, path_hash, version_hash, index);
+  pthread_mutex_lock(&cache_lock);
+  t_cache_entry *entry = find_entry(path_hash, index);
+  if(entry)
+    remove_entry(entry);
+  evict_for(total);
+  if(rename(tmp_name, name)) {
+    unlink(tmp_name);
+    pthread_mutex_unlock(&cache_lock);
+    return;
+  }
+  entry = (t_cache_entry*) calloc(1, sizeof(t_cache_entry));
+  entry->path_hash = path_hash;
+  entry->version_hash = version_hash;
+  entry->index = index;
+  entry->size = total;
+  insert_entry(entry);
+  stores++;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+void blockcache_drop(const char *path, const char *version, int index) {
+  uint64_t path_hash = hash_string(path), version_hash = hash_string(version);
+  if(!buckets)
+    return;
+  pthread_mutex_lock(&cache_lock);
+  t_cache_entry *entry = find_entry(path_hash, index);
+  if(entry && entry->version_hash == version_hash)
+    remove_entry(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+int blockcache_stats(char *out, size_t size) {
+  pthread_mutex_lock(&cache_lock);
+  int len = snprintf(out, size,
+                     "blockcache_bytes=%zu\n"
+                     "blockcache_entries=%zu\n"
+                     "blockcache_hits=%zu\n"
+                     "blockcache_misses=%zu\n"
+                     "blockcache_stores=%zu\n"
+                     "blockcache_evictions=%zu\n"
+                     "blockcache_revalidated=%zu\n"
+                     "blockcache_changed=%zu\n",
+                     used_bytes, entries, hits, misses, stores, evictions,
+                     revalidated, changed);
+  pthread_mutex_unlock(&cache_lock);
+  return len;
+}
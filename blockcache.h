@@ -0,0 +1,31 @@
+#include <stdlib.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#ifndef BLOCKCACHE_GUARD
+#define BLOCKCACHE_GUARD
+
+  #define BLOCKCACHE_VERSION_SIZE 256
+
+  char *CACHE_DIR;
+  size_t CACHE_BYTES;
+
+  /* Persistent cache of downloaded chunks, kept compressed as fetched in
+     CACHE_DIR and shared by every open of an object, across remounts.
+     A chunk is keyed by the object's path, its version (ETag) and its
+     index, so a chunk of an older version is never returned for a newer
+     one. Files are dropped least recently used first to stay within
+     CACHE_BYTES. The last version seen of each object is remembered as
+     well, so that each open can tell whether the object has changed. */
+  void blockcache_init();
+  int blockcache_enabled();
+  int blockcache_known_version(const char *path, char *version, size_t size);
+  void blockcache_set_version(const char *path, const char *version, int unchanged);
+  int blockcache_get(const char *path, const char *version, int index,
+                     char *data, size_t capacity, size_t *size);
+  void blockcache_put(const char *path, const char *version, int index,
+                      const char *data, size_t size);
+  void blockcache_drop(const char *path, const char *version, int index);
+  int blockcache_stats(char *out, size_t size);
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include "bufpool.h"
+#include "chunkbuf.h"
+#include "zpipe.h"
+
+typedef struct pooled_buf {
+  struct pooled_buf *next;
+  int pool_class;
+  size_t size;
+} t_pooled_buf;
+
+static t_pooled_buf *free_list[BUFPOOL_CLASSES];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t pool_hits = 0;
+static size_t pool_misses = 0;
+static size_t pool_outstanding = 0;
+static size_t pool_high_water = 0;
+static size_t pool_idle = 0;
+
+static size_t class_size(int pool_class) {
+  size_t base = CHUNK + CHUNK / 8;
+  base = (base + BUFPOOL_ALIGN - 1) & ~(size_t)(BUFPOOL_ALIGN - 1);
+  return base << pool_class;
+}
+
+static t_pooled_buf * header_of(void *buf) {
+  return (t_pooled_buf*) ((char*)buf - BUFPOOL_ALIGN);
+}
+
+void * get_buffer(size_t size) {
+  int pool_class;
+  t_pooled_buf *header = NULL;
+
+  for(pool_class = 0; pool_class < BUFPOOL_CLASSES; pool_class++)
+    if(class_size(pool_class) >= size)
+      break;
+  size_t alloc = pool_class < BUFPOOL_CLASSES ? class_size(pool_class) : size;
+
+  pthread_mutex_lock(&pool_lock);
+  if(pool_class < BUFPOOL_CLASSES && free_list[pool_class] != NULL) {
+    header = free_list[pool_class];
+    free_list[pool_class] = header->next;
+    pool_idle -= alloc;
+    pool_hits++;
+  } else {
+    pool_misses++;
+  }
+  pool_outstanding += alloc;
+  if(pool_outstanding > pool_high_water)
+    pool_high_water = pool_outstanding;
+  pthread_mutex_unlock(&pool_lock);
+
+  if(header == NULL) {
+    void *mem;
+    if(posix_memalign(&mem, BUFPOOL_ALIGN, BUFPOOL_ALIGN + alloc)) {
+      pthread_mutex_lock(&pool_lock);
+      pool_outstanding -= alloc;
+      pthread_mutex_unlock(&pool_lock);
+      return NULL;
+    }
+    header = (t_pooled_buf*) mem;
+    header->pool_class = pool_class;
+    header->size = alloc;
+  }
+  header->next = NULL;
+  return (char*)header + BUFPOOL_ALIGN;
+}
+
+/* Returns a buffer to its class, or frees it once the idle buffers would
+   hold more than the CHUNK_MEMORY budget. */
+void put_buffer(void *buf) {
+  if(buf == NULL)
+    return;
+  t_pooled_buf *header = header_of(buf);
+
+  pthread_mutex_lock(&pool_lock);
+  pool_outstanding -= header->size;
+  if(header->pool_class < BUFPOOL_CLASSES && pool_idle + header->size <= CHUNK_MEMORY) {
+    header->next = free_list[header->pool_class];
+    free_list[header->pool_class] = header;
+    pool_idle += header->size;
+    header = NULL;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  free(header);
+}
+
+size_t buffer_size(void *buf) {
+  return header_of(buf)->size;
+}
+
+int bufpool_stats(char *out, size_t size) {
+  pthread_mutex_lock(&pool_lock);
+  int len = snprintf(out, size,
+                     "bufpool_hits=%zu\n"
+                     "bufpool_misses=%zu\n"
+                     "bufpool_outstanding_bytes=%zu\n"
+                     "bufpool_high_water_bytes=%zu\n"
+                     "bufpool_idle_bytes=%zu\n",
+                     pool_hits, pool_misses, pool_outstanding,
+                     pool_high_water, pool_idle);
+  pthread_mutex_unlock(&pool_lock);
+  return len;
+}
\ No newline at end of file
@@ -0,0 +1,18 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifndef BUFPOOL_GUARD
+#define BUFPOOL_GUARD
+
+  #define BUFPOOL_CLASSES 4
+  #define BUFPOOL_ALIGN 64
+
+  /* Recycled buffers for chunk data. Class 0 holds CHUNK bytes plus room
+     for compression overhead and each further class doubles it; larger
+     requests bypass the pool. */
+  void * get_buffer(size_t size);
+  void put_buffer(void *buf);
+  size_t buffer_size(void *buf);
+  int bufpool_stats(char *out, size_t size);
+
+#endif
\ No newline at end of file
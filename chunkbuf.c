@@ -0,0 +1,84 @@
+#include <string.h>
+#include "chunkbuf.h"
+#include "bufpool.h"
+
+static size_t chunk_memory_used = 0;
+
+static int reserve_memory(size_t size) {
+  size_t used = __atomic_load_n(&chunk_memory_used, __ATOMIC_RELAXED);
+  do {
+    if(used + size > CHUNK_MEMORY)
+      return 0;
+  } while(!__atomic_compare_exchange_n(&chunk_memory_used, &used, used + size, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 1;
+}
+
+static void release_memory(size_t size) {
+  __atomic_sub_fetch(&chunk_memory_used, size, __ATOMIC_RELAXED);
+}
+
+/* Returns a chunk with capacity bytes of memory reserved, or with no
+   memory at all (data == NULL) when the budget is exhausted, in which
+   case the caller is expected to spill_chunk_buf(). */
+t_chunk_buf * new_chunk_buf(size_t capacity) {
+  t_chunk_buf *chunk = (t_chunk_buf*) calloc(1, sizeof(t_chunk_buf));
+  if(reserve_memory(capacity)) {
+    chunk->data = (char*) get_buffer(capacity);
+    if(chunk->data == NULL)
+      release_memory(capacity);
+    else
+      chunk->capacity = capacity;
+  }
+  return chunk;
+}
+
+int spill_chunk_buf(t_chunk_buf *chunk, const char *data, size_t size) {
+  chunk->spill = tmpfile();
+  if(chunk->spill == NULL)
+    return 0;
+  if(fwrite(data, 1, size, chunk->spill) != size || fflush(chunk->spill))
+    return 0;
+  chunk->size = size;
+  return 1;
+}
+
+void rewind_chunk_buf(t_chunk_buf *chunk) {
+  chunk->pos = 0;
+  if(chunk->spill != NULL)
+    rewind(chunk->spill);
+}
+
+/* CURLOPT_READFUNCTION for in-memory chunks */
+size_t read_chunk_buf(void *ptr, size_t size, size_t nmemb, void *stream) {
+  t_chunk_buf *chunk = (t_chunk_buf*) stream;
+  size_t left = chunk->size - chunk->pos;
+  size_t want = size * nmemb;
+  if(want > left)
+    want = left;
+  memcpy(ptr, chunk->data + chunk->pos, want);
+  chunk->pos += want;
+  return want;
+}
+
+/* CURLOPT_WRITEFUNCTION filling an in-memory chunk; a response larger
+   than the chunk's capacity fails the transfer */
+size_t write_chunk_buf(void *ptr, size_t size, size_t nmemb, void *stream) {
+  t_chunk_buf *chunk = (t_chunk_buf*) stream;
+  size_t got = size * nmemb;
+  if(got > chunk->capacity - chunk->size)
+    return 0;
+  memcpy(chunk->data + chunk->size, ptr, got);
+  chunk->size += got;
+  return got;
+}
+
+void free_chunk_buf(t_chunk_buf *chunk) {
+  if(chunk->data != NULL) {
+    put_buffer(chunk->data);
+    release_memory(chunk->capacity);
+  }
+  if(chunk->spill != NULL)
+    fclose(chunk->spill);
+  free(chunk);
+}
\ No newline at end of file
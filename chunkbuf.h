@@ -0,0 +1,30 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "dedup.h"
+
+#ifndef CHUNKBUF_GUARD
+#define CHUNKBUF_GUARD
+
+  size_t CHUNK_MEMORY;
+
+  /* A compressed chunk waiting to be uploaded. It lives in data while the
+     process-wide CHUNK_MEMORY budget allows it, otherwise it is spilled
+     to a tmpfile. */
+  typedef struct chunk_buf {
+    char *data;
+    size_t capacity;
+    size_t size;
+    size_t pos;
+    FILE *spill;
+    int hashed;
+    unsigned char digest[DEDUP_DIGEST_SIZE];
+  } t_chunk_buf;
+
+  t_chunk_buf * new_chunk_buf(size_t capacity);
+  int spill_chunk_buf(t_chunk_buf *chunk, const char *data, size_t size);
+  void rewind_chunk_buf(t_chunk_buf *chunk);
+  size_t read_chunk_buf(void *ptr, size_t size, size_t nmemb, void *stream);
+  size_t write_chunk_buf(void *ptr, size_t size, size_t nmemb, void *stream);
+  void free_chunk_buf(t_chunk_buf *chunk);
+
+#endif
\ No newline at end of file
@@ -18,6 +18,7 @@
 #include <libxml/xpath.h>
 #include <libxml/xpathInternals.h>
 #include "cloudfsapi.h"
+#include "blockcache.h"
 #include "config.h"
 
 #define RHEL5_LIBCURL_VERSION 462597
@@ -66,6 +67,14 @@ static size_t xml_dispatch(void *ptr, size_t size, size_t nmemb, void *stream)
   return size * nmemb;
 }
 
+/* Decodes a compressed GET as it arrives; an error aborts the transfer. */
+static size_t inflate_dispatch(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+  if (push_inflater((t_inflater *)stream, (const char *)ptr, size * nmemb) != Z_OK)
+    return 0;
+  return size * nmemb;
+}
+
 static CURL *get_connection(const char *path)
 {
   pthread_mutex_lock(&pool_mut);
@@ -95,7 +104,8 @@ static void add_header(curl_slist **headers, const char *name,
 }
 
 static int send_request(char *method, const char *path, FILE *fp,
-                        xmlParserCtxtPtr xmlctx, curl_slist *extra_headers)
+                        t_chunk_buf *chunk, xmlParserCtxtPtr xmlctx,
+                        t_inflater *inflater, curl_slist *extra_headers)
 {
   char url[MAX_URL_SIZE];
   char *slash;
@@ -143,9 +153,22 @@ static int send_request(char *method, const char *path, FILE *fp,
     {
       rewind(fp);
       curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
-      curl_easy_setopt(curl, CURLOPT_INFILESIZE, cloudfs_file_size(fileno(fp)));
+      curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)cloudfs_file_size(fileno(fp)));
       curl_easy_setopt(curl, CURLOPT_READDATA, fp);
     }
+    else if (!strcasecmp(method, "PUT") && chunk)
+    {
+      rewind_chunk_buf(chunk);
+      curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
+      curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)chunk->size);
+      if (chunk->spill)
+        curl_easy_setopt(curl, CURLOPT_READDATA, chunk->spill);
+      else
+      {
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, &read_chunk_buf);
+        curl_easy_setopt(curl, CURLOPT_READDATA, chunk);
+      }
+    }
     else if (!strcasecmp(method, "GET"))
     {
       if (fp)
@@ -157,13 +180,36 @@ static int send_request(char *method, const char *path, FILE *fp,
           debugf("ftruncate failed.  I don't know what to do about that.");
           abort();
         }
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+        if (inflater)
+        {
+          reset_inflater(inflater);
+          curl_easy_setopt(curl, CURLOPT_WRITEDATA, inflater);
+          curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &inflate_dispatch);
+        }
+        else
+          curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
       }
       else if (xmlctx)
       {
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, xmlctx);
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &xml_dispatch);
       }
+      else if (chunk)
+      {
+        chunk->size = 0;
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, chunk);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &write_chunk_buf);
+      }
+    }
+    else if (!strcasecmp(method, "HEAD"))
+    {
+      curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
+      if (chunk)
+      {
+        chunk->size = 0;
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, chunk);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &write_chunk_buf);
+      }
     }
     else
       curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method);
@@ -208,52 +254,128 @@ static size_t header_dispatch(void *ptr, size_t size, size_t nmemb, void *stream
   return size * nmemb;
 }
 
-int write_iter;
-pthread_mutex_t write_iter_lock;
+/*
+ * Finds header name among the response headers a HEAD collected in
+ * headers and copies its value.
+ */
+static int response_header(t_chunk_buf *headers, const char *name,
+                           char *value, size_t size)
+{
+  size_t len = strlen(name);
+  char *line = headers->data, *end = headers->data + headers->size;
+  while (line < end)
+  {
+    char *eol = memchr(line, '\n', end - line);
+    if (!eol)
+      eol = end;
+    if ((size_t)(eol - line) > len && line[len] == ':' &&
+        !strncasecmp(line, name, len))
+    {
+      char *start = line + len + 1, *stop = eol;
+      while (start < stop && (*start == ' ' || *start == '\t'))
+        start++;
+      while (stop > start && (stop[-1] == '\r' || stop[-1] == ' '))
+        stop--;
+      if (stop == start || (size_t)(stop - start) >= size)
+        return 0;
+      memcpy(value, start, stop - start);
+      value[stop - start] = '\0';
+      return 1;
+    }
+    line = eol + 1;
+  }
+  return 0;
+}
+
+/*
+ * Sends a compressed chunk as piece i of store_path and frees it.
+ */
+static int put_chunk(const char *store_path, int i, t_chunk_buf *chunk)
+{
+  char iStr[10];
+  sprintf(iStr, "%d", i);
 
-void set_write_iter() {
-  pthread_mutex_lock(&write_iter_lock);
-  int ret = write_iter++;
-  pthread_mutex_unlock(&write_iter_lock);
+  curl_slist *headers = NULL;
+  add_header(&headers, "X-Chunk-Index", iStr);
+
+  char *encoded = curl_escape(store_path, 0);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int response = send_request("PUT", encoded, NULL, chunk, NULL, NULL, headers);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  int ok = response >= 200 && response < 300;
+  if (ok) {
+    record_upload(chunk->size, (end.tv_sec - start.tv_sec) +
+                               (end.tv_nsec - start.tv_nsec) / 1e9);
+    if (chunk->hashed)
+      dedup_store(store_path, i, chunk->digest);
+  }
+  curl_free(encoded);
+  curl_slist_free_all(headers);
+  free_chunk_buf(chunk);
+  return ok;
 }
 
-int get_write_iter() {
-  pthread_mutex_lock(&write_iter_lock);
-  int ret = write_iter;
-  pthread_mutex_unlock(&write_iter_lock);
-  return ret;
+/*
+ * Reads chunk i of the size-byte file in fd into buf and compresses it.
+ * Returns NULL with *ok cleared on failure, or NULL with *ok set if the
+ * chunk is already stored and need not be sent. scratch is a compression
+ * buffer, allocated on first use, for chunks that do not fit in memory.
+ */
+static t_chunk_buf *prepare_chunk(int fd, const char *path, int i, off_t size,
+                                  char *buf, char **scratch, int *ok)
+{
+  size_t bound = adaptive_deflate_bound(CHUNK);
+  off_t begin = (off_t)i*CHUNK;
+  size_t length = (size - begin < CHUNK ? size - begin : CHUNK);
+
+  *ok = 1;
+  if (pread(fd, buf, length, begin) != (ssize_t)length) {
+    debugf("short read of chunk %d", i);
+    *ok = 0;
+    return NULL;
+  }
+
+  unsigned char digest[DEDUP_DIGEST_SIZE];
+  int hashed = chunk_digest(buf, length, digest);
+  if (hashed && dedup_lookup(path, i, digest))
+    return NULL;
+
+  t_chunk_buf *chunk = new_chunk_buf(bound);
+  if (!chunk->data && !*scratch)
+    *scratch = (char*) get_buffer(bound);
+  char *out = chunk->data ? chunk->data : *scratch;
+  size_t out_len = bound;
+
+  *ok = adaptive_deflate(buf, length, out, &out_len) == Z_OK;
+  if (*ok && chunk->data)
+    chunk->size = out_len;
+  else if (*ok)
+    *ok = spill_chunk_buf(chunk, *scratch, out_len);
+
+  if (!*ok) {
+    debugf("unable to compress chunk %d", i);
+    free_chunk_buf(chunk);
+    return NULL;
+  }
+  chunk->hashed = hashed;
+  if (hashed)
+    memcpy(chunk->digest, digest, DEDUP_DIGEST_SIZE);
+  return chunk;
 }
 
 void* write_splits(void* in) {
   t_thread_pass *data = (t_thread_pass *) in;
   const char* store_path = data->path;
-  int blocks = data->blocks;
+  t_fifo *fifo = data->fifo;
 
   intptr_t result = 1;
-  int i = get_write_iter();
-  t_fifo_elem *elem = pop_fifo();
-
-  while (i < blocks) {
-    if(elem != NULL) {
-      FILE *tmp = elem->data;
-      i = elem->index;
-
-      char iStr[10];
-      sprintf(iStr, "%d", i);
-
-      curl_slist *headers = NULL;
-      add_header(&headers, "X-Chunk-Index", iStr);
-
-      char *encoded = curl_escape(store_path, 0);
-      int response = send_request("PUT", encoded, tmp, NULL, headers);
-      result = (response >= 200 && response < 300) && result;
-      curl_free(encoded);
-      fclose(tmp);
+  int i;
+  t_chunk_buf *chunk;
 
-      set_write_iter();
-    }
-    i = get_write_iter();
-    elem = pop_fifo();
+  while (pop_fifo(fifo, &i, (void**)&chunk)) {
+    if (!put_chunk(store_path, i, chunk))
+      result = 0;
   }
 
   pthread_exit((void*) result);
@@ -261,86 +383,356 @@ void* write_splits(void* in) {
   return 0;
 }
 
+static int next_block(t_thread_pass *data) {
+  return __atomic_fetch_add(&data->next_block, 1, __ATOMIC_RELAXED);
+}
+
 void* create_splits(void* in) {
   t_thread_pass *data = (t_thread_pass *) in;
-  char *file = data->data;
+  int fd = data->fd;
+  const char *path = data->path;
+  const unsigned char *dirty = data->dirty;
+  int dirty_blocks = data->dirty_blocks;
   int blocks = data->blocks;
-  long size = data->size;
+  off_t size = data->size;
+  t_fifo *fifo = data->fifo;
 
-  int i;
-
-  reset_level();
-
-  for (i = 0; i < blocks; i++) {
-    int fifo_size_at_start = fifo_size();
-
-    char *buf = (char*)calloc(CHUNK+1,sizeof(char));
-    FILE *tmp = tmpfile();
-    FILE *store = tmpfile();
+  intptr_t result = 1;
+  int i, ok;
+  char *buf = (char*) get_buffer(CHUNK);
+  char *scratch = NULL;
+
+  for (i = next_block(data); i < blocks; i = next_block(data)) {
+    if (dirty && i < dirty_blocks && !CHUNK_DIRTY(dirty, i))
+      continue;
+
+    t_chunk_buf *chunk = prepare_chunk(fd, path, i, size, buf, &scratch, &ok);
+    if (!ok)
+      result = 0;
+    if (chunk)
+      push_fifo(fifo, i, chunk);
+  }
 
-    long begin = i*CHUNK;
-    long end = (i*CHUNK+CHUNK-1 > size ? size : i*CHUNK+CHUNK);
+  put_buffer(buf);
+  put_buffer(scratch);
+  pthread_exit((void*) result);
 
-    fwrite(&file[i*CHUNK], sizeof(char), end-begin, tmp);
-    fflush(tmp);
-    fseek(tmp, 0L, SEEK_SET);
+  return 0;
+}
 
-    adaptive_deflate(tmp, store);
-    fclose(tmp);
-    push_fifo(i, store);
+/*
+ * Streaming uploads send the chunks a sequential writer has finished
+ * while it is still writing. Chunks are queued by index and read back
+ * from fd by a thread of their own; the manifest is left to the next
+ * cloudfs_object_read_fp() of the file.
+ */
+static void *stream_chunks(void *in)
+{
+  t_stream_upload *stream = (t_stream_upload *) in;
+  char *buf = (char*) get_buffer(CHUNK);
+  char *scratch = NULL;
+  int i, ok;
+  void *unused;
+
+  while (pop_fifo(stream->fifo, &i, &unused)) {
+    t_chunk_buf *chunk = prepare_chunk(stream->fd, stream->path, i,
+                                       (off_t)(i + 1) * CHUNK, buf, &scratch, &ok);
+    if (chunk && !put_chunk(stream->path, i, chunk))
+      ok = 0;
+    if (!ok)
+      stream->result = 0;
+  }
 
-    free(buf);
+  put_buffer(buf);
+  put_buffer(scratch);
+  return NULL;
+}
 
-    int fifo_diff = fifo_size() - fifo_size_at_start;
-    update_level(fifo_diff);
+t_stream_upload *cloudfs_stream_begin(const char *path, int fd)
+{
+  t_stream_upload *stream = (t_stream_upload *) calloc(1, sizeof(t_stream_upload));
+  stream->path = strdup(path);
+  stream->fd = dup(fd);
+  stream->fifo = new_fifo(QUEUE_SIZE);
+  stream->result = 1;
+  if (pthread_create(&stream->thread, NULL, stream_chunks, stream))
+  {
+    free_fifo(stream->fifo);
+    close(stream->fd);
+    free(stream->path);
+    free(stream);
+    return NULL;
   }
+  return stream;
+}
 
-  return 0;
+/* Queues complete chunk index for upload, waiting while the queue is full. */
+void cloudfs_stream_chunk(t_stream_upload *stream, int index)
+{
+  push_fifo(stream->fifo, index, NULL);
 }
 
-int split_file_and_put(const char* path, FILE* fp, FILE* temp, long size) {
+/* Waits for the queued chunks and frees the stream. Returns 1 if every
+   one of them was stored. */
+int cloudfs_stream_end(t_stream_upload *stream)
+{
+  close_fifo(stream->fifo);
+  pthread_join(stream->thread, NULL);
+  int result = stream->result;
+  free_fifo(stream->fifo);
+  close(stream->fd);
+  free(stream->path);
+  free(stream);
+  return result;
+}
+
+int split_file_and_put(const char* path, int fd, FILE* temp, off_t size,
+                       const unsigned char *dirty, int dirty_blocks) {
   int blocks;
-  pthread_t create_thread, write_thread, write_thread_2;
+  pthread_t *create_threads = (pthread_t*) malloc(COMPRESS_THREADS*sizeof(pthread_t));
   pthread_t *write_threads = (pthread_t*) malloc(NUM_THREADS*sizeof(pthread_t));
 
-  blocks = ceil((float)size/CHUNK);
-  char* file = (char*) calloc(1, CHUNK*blocks);
+  blocks = (size + CHUNK - 1) / CHUNK;
 
   fprintf(temp, "%d", blocks);
 
-  if(fread(file, sizeof(char), size, fp) != size)
-    return 0;
-  
   t_thread_pass *pass_splits = (t_thread_pass *) malloc(sizeof(t_thread_pass));
   t_thread_pass *pass_write = (t_thread_pass *) malloc(sizeof(t_thread_pass));
 
-  pass_splits->data = file;
+  pass_splits->fd = fd;
+  pass_splits->path = path;
+  pass_splits->dirty = dirty;
+  pass_splits->dirty_blocks = dirty_blocks;
   pass_splits->blocks = blocks;
   pass_splits->size = size;
 
   pass_write->path = path;
   pass_write->blocks = blocks;
 
+  t_fifo *fifo = new_fifo(QUEUE_SIZE);
+  pass_splits->fifo = fifo;
+  pass_write->fifo = fifo;
+
   int result = 1;
 
-  pthread_mutex_init(&write_iter_lock, NULL);
-  write_iter = 0;
+  pass_splits->next_block = 0;
   int i = 0;
 
-  pthread_create(&create_thread, NULL, create_splits, pass_splits);
+  reset_level(COMPRESS_THREADS, NUM_THREADS);
+
+  for(i = 0; i < COMPRESS_THREADS; i++) {
+    pthread_create(&create_threads[i], NULL, create_splits, pass_splits);
+  }
   for(i = 0; i < NUM_THREADS; i++) {
     pthread_create(&write_threads[i], NULL, write_splits, pass_write);
   }
 
-  pthread_join(create_thread, NULL);
+  for(i = 0; i < COMPRESS_THREADS; i++) {
+    void *res;
+    pthread_join(create_threads[i], &res);
+    result = result && (intptr_t)res;
+  }
+  close_fifo(fifo);
   for(i = 0; i < NUM_THREADS; i++) {
-    int res;
-    pthread_join(write_threads[i], (void **)&res);
-    result = result && res;
+    void *res;
+    pthread_join(write_threads[i], &res);
+    result = result && (intptr_t)res;
+  }
+
+  free_fifo(fifo);
+
+  free(create_threads);
+  free(write_threads);
+  free(pass_splits);
+  free(pass_write);
+
+  return result;
+}
+
+typedef struct fd_sink {
+  int fd;
+  off_t offset;
+} t_fd_sink;
+
+static size_t write_fp_sink(const char *data, size_t len, void *ctx)
+{
+  return fwrite(data, 1, len, (FILE *) ctx);
+}
+
+static size_t write_fd_sink(const char *data, size_t len, void *ctx)
+{
+  t_fd_sink *sink = (t_fd_sink *) ctx;
+  ssize_t written = pwrite(sink->fd, data, len, sink->offset);
+  if (written > 0)
+    sink->offset += written;
+  return written < 0 ? 0 : written;
+}
+
+static t_chunk_buf *new_download_buf()
+{
+  t_chunk_buf *download = (t_chunk_buf *) calloc(1, sizeof(t_chunk_buf));
+  /* no codec expands a chunk by anything close to this much */
+  download->capacity = 2 * (size_t)CHUNK + 4096;
+  if (!(download->data = (char *) get_buffer(download->capacity)))
+  {
+    free(download);
+    return NULL;
+  }
+  return download;
+}
+
+static void free_download_buf(t_chunk_buf *download)
+{
+  put_buffer(download->data);
+  free(download);
+}
+
+/*
+ * Makes a GET of part of path, or of a copy to be cached under version,
+ * fail with 412 unless the object is still at version, so that pieces of
+ * two versions are never mixed or cached under the wrong one. A version
+ * taken from Last-Modified is a date, checked with If-Unmodified-Since.
+ */
+static void add_version_header(curl_slist **headers, const char *version)
+{
+  if (strstr(version, "GMT"))
+    add_header(headers, "If-Unmodified-Since", version);
+  else
+    add_header(headers, "If-Match", version);
+}
+
+/*
+ * Fetches piece index of path, as stored by the chunked upload, still
+ * compressed. When the object's version is known the block cache is
+ * tried first, and a chunk fetched from the store is added to it.
+ */
+static int get_chunk(const char *path, const char *version, int index,
+                     t_chunk_buf *download)
+{
+  if (version && blockcache_get(path, version, index, download->data,
+                                download->capacity, &download->size))
+    return 1;
+  char iStr[10];
+  sprintf(iStr, "%d", index);
+  curl_slist *headers = NULL;
+  add_header(&headers, "X-Get-Compressed", "true");
+  add_header(&headers, "X-Chunk-Index", iStr);
+  if (version)
+    add_version_header(&headers, version);
+  char *encoded = curl_escape(path, 0);
+  int response = send_request("GET", encoded, NULL, download, NULL, NULL, headers);
+  curl_free(encoded);
+  curl_slist_free_all(headers);
+  if (response == 412)
+    debugf("%s changed from version %s", path, version);
+  if (response < 200 || response >= 300)
+    return 0;
+  if (version)
+    blockcache_put(path, version, index, download->data, download->size);
+  return 1;
+}
+
+/*
+ * Decodes a fetched chunk into fd at offset. Returns the number of bytes
+ * written, or -1 if it does not decode.
+ */
+static ssize_t decode_chunk(t_chunk_buf *download, int fd, off_t offset)
+{
+  t_fd_sink sink = {fd, offset};
+  t_inflater *inflater = new_inflater(write_fd_sink, &sink);
+  int ret = inflater ? push_inflater(inflater, download->data, download->size) : Z_MEM_ERROR;
+  if (finish_inflater(inflater) != Z_OK || ret != Z_OK)
+    return -1;
+  return sink.offset - offset;
+}
+
+void* download_splits(void* in) {
+  t_thread_pass *data = (t_thread_pass *) in;
+  intptr_t result = 1;
+  int i;
+
+  for (i = next_block(data); i < data->blocks; i = next_block(data)) {
+    t_chunk_buf *download = new_download_buf();
+    if (!download || !get_chunk(data->path, data->version, i, download)) {
+      if (download)
+        free_download_buf(download);
+      /* no point fetching the rest */
+      __atomic_store_n(&data->next_block, data->blocks, __ATOMIC_RELAXED);
+      result = 0;
+      break;
+    }
+    push_fifo(data->fifo, i, download);
   }
 
-  pthread_mutex_destroy(&write_iter_lock);
+  pthread_exit((void*) result);
+
+  return 0;
+}
+
+void* inflate_splits(void* in) {
+  t_thread_pass *data = (t_thread_pass *) in;
+  intptr_t result = 1;
+  int i;
+  t_chunk_buf *download;
+
+  while (pop_fifo(data->fifo, &i, (void**)&download)) {
+    off_t begin = (off_t)i*CHUNK;
+    ssize_t length = (data->size - begin < CHUNK ? data->size - begin : CHUNK);
+    if (decode_chunk(download, data->fd, begin) != length) {
+      if (data->version)
+        blockcache_drop(data->path, data->version, i);
+      result = 0;
+    }
+    free_download_buf(download);
+  }
+
+  pthread_exit((void*) result);
+
+  return 0;
+}
+
+/*
+ * The download counterpart of split_file_and_put(): NUM_THREADS
+ * connections fetch chunks by index while COMPRESS_THREADS threads
+ * decode them into place in fd.
+ */
+static int get_splits(const char *path, const char *version, int fd, off_t size)
+{
+  int i, result = 1;
+  t_thread_pass pass = {0};
 
+  if (ftruncate(fd, size))
+    return 0;
+
+  pthread_t *get_threads = (pthread_t*) malloc(NUM_THREADS*sizeof(pthread_t));
+  pthread_t *inflate_threads = (pthread_t*) malloc(COMPRESS_THREADS*sizeof(pthread_t));
+  pass.fd = fd;
+  pass.path = path;
+  pass.version = version;
+  pass.size = size;
+  pass.blocks = (size + CHUNK - 1) / CHUNK;
+  pass.fifo = new_fifo(QUEUE_SIZE);
+
+  for (i = 0; i < NUM_THREADS; i++)
+    pthread_create(&get_threads[i], NULL, download_splits, &pass);
+  for (i = 0; i < COMPRESS_THREADS; i++)
+    pthread_create(&inflate_threads[i], NULL, inflate_splits, &pass);
+
+  for (i = 0; i < NUM_THREADS; i++) {
+    void *res;
+    pthread_join(get_threads[i], &res);
+    result = result && (intptr_t)res;
+  }
+  close_fifo(pass.fifo);
+  for (i = 0; i < COMPRESS_THREADS; i++) {
+    void *res;
+    pthread_join(inflate_threads[i], &res);
+    result = result && (intptr_t)res;
+  }
+
+  free_fifo(pass.fifo);
+  free(get_threads);
+  free(inflate_threads);
   return result;
 }
 
@@ -382,61 +774,194 @@ void cloudfs_init()
   }
 }
 
-int cloudfs_object_read_fp(const char *path, FILE *fp)
+/*
+ * Uploads fp as path. When dirty is given, only the chunks flagged in it
+ * (and any past dirty_blocks) are sent; the rest are assumed to be stored
+ * remotely already and are kept by the manifest.
+ */
+int cloudfs_object_read_fp(const char *path, FILE *fp,
+                           const unsigned char *dirty, int dirty_blocks)
 {
   fflush(fp);
   rewind(fp);
 
   FILE *tmp = tmpfile();
-  
-  fseek(fp, 0L, SEEK_END);
-  long size = ftell(fp);
-  rewind(fp);
+  off_t size = cloudfs_file_size(fileno(fp));
+
+  if (!split_file_and_put(path, fileno(fp), tmp, size, dirty, dirty_blocks))
+  {
+    fclose(tmp);
+    return 0;
+  }
 
-  split_file_and_put(path, fp, tmp, size);
-  
   curl_slist *headers = NULL;
   add_header(&headers, "X-Write-To-Core", "true");
   add_header(&headers, "Expect", "");
 
   char *encoded = curl_escape(path, 0);
-  int response = send_request("PUT", encoded, tmp, NULL, headers);
+  int response = send_request("PUT", encoded, tmp, NULL, NULL, NULL, headers);
   fclose(tmp);
   curl_free(encoded);
-  return (response >= 200 && response < 300);
+  if (response >= 200 && response < 300)
+  {
+    dedup_forget(path, (size + CHUNK - 1) / CHUNK);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Reads an object of at most one chunk, which is stored as that chunk,
+ * through the block cache as piece 0. A miss fetches the whole object
+ * with a single GET and caches it.
+ */
+static int get_small_object(const char *path, const char *version, FILE *fp)
+{
+  t_chunk_buf *download = new_download_buf();
+  if (!download)
+    return 0;
+  int ok = blockcache_get(path, version, 0, download->data,
+                          download->capacity, &download->size);
+  if (!ok)
+  {
+    char *encoded = curl_escape(path, 0);
+    curl_slist *headers = NULL;
+    add_header(&headers, "X-Get-Compressed", "true");
+    add_version_header(&headers, version);
+    int response = send_request("GET", encoded, NULL, download, NULL, NULL, headers);
+    curl_free(encoded);
+    curl_slist_free_all(headers);
+    if (response == 412)
+      debugf("%s changed from version %s", path, version);
+    if ((ok = response >= 200 && response < 300))
+      blockcache_put(path, version, 0, download->data, download->size);
+  }
+  fflush(fp);
+  if (ok && decode_chunk(download, fileno(fp), 0) < 0)
+  {
+    debugf("unable to decode %s", path);
+    blockcache_drop(path, version, 0);
+    ok = 0;
+  }
+  free_download_buf(download);
+  return ok;
 }
 
-int cloudfs_object_write_fp(const char *path, FILE *fp)
+/*
+ * Downloads path into fp. When the object's size is known (size >= 0)
+ * and it spans several chunks, they are fetched in parallel; either way
+ * it is read through the block cache if version is given. Objects that
+ * cannot be read by chunk, or that changed from version meanwhile, fall
+ * back to a single GET of whatever version is current.
+ */
+int cloudfs_object_write_fp(const char *path, FILE *fp, off_t size,
+                            const char *version)
 {
+  if (version && size >= 0 && size <= CHUNK)
+  {
+    if (get_small_object(path, version, fp))
+      return 1;
+    debugf("cached download of %s failed, fetching it whole", path);
+    if (ftruncate(fileno(fp), 0))
+      return 0;
+    rewind(fp);
+  }
+  if (size > CHUNK)
+  {
+    fflush(fp);
+    if (get_splits(path, version, fileno(fp), size))
+      return 1;
+    debugf("parallel download of %s failed, fetching it whole", path);
+    if (ftruncate(fileno(fp), 0))
+      return 0;
+  }
+
   char *encoded = curl_escape(path, 0);
-  FILE *tmp = tmpfile();
+  t_inflater *inflater = new_inflater(write_fp_sink, fp);
   curl_slist *headers = NULL;
   add_header(&headers, "X-Get-Compressed", "true");
-  int response = send_request("GET", encoded, tmp, NULL, headers);
+  int response = send_request("GET", encoded, fp, NULL, NULL, inflater, headers);
   curl_free(encoded);
-  fflush(tmp);
-  rewind(tmp);
-  adaptive_inflate(tmp, fp);
+  curl_slist_free_all(headers);
+  int decoded = finish_inflater(inflater) == Z_OK;
   fflush(fp);
-  if ((response >= 200 && response < 300) || ftruncate(fileno(fp), 0))
+  int ok = response >= 200 && response < 300;
+  if (ok && !decoded)
+  {
+    debugf("unable to decode %s", path);
+    ok = 0;
+  }
+  if (ok || ftruncate(fileno(fp), 0))
     return 1;
   rewind(fp);
   return 0;
 }
 
+/*
+ * Downloads piece index of path and writes it decoded at offset in fd.
+ * Returns the number of bytes written, or -1 if the chunk could not be
+ * fetched or decoded.
+ */
+ssize_t cloudfs_object_read_chunk(const char *path, int index, int fd, off_t offset,
+                                  const char *version)
+{
+  ssize_t result = -1;
+  t_chunk_buf *download = new_download_buf();
+  if (!download)
+    return -1;
+  if (get_chunk(path, version, index, download) &&
+      (result = decode_chunk(download, fd, offset)) < 0 && version)
+    blockcache_drop(path, version, index);
+  free_download_buf(download);
+  return result;
+}
+
+/*
+ * Looks up the current size of path with a HEAD, as a listing may be
+ * older than the object, and, when the block cache is on, its version
+ * for the cache: its ETag, or failing that its Last-Modified date.
+ * version is left empty when no version could be had, in which case the
+ * object is read without the cache. Returns 0 if the HEAD failed.
+ */
+int cloudfs_object_info(const char *path, off_t *size, char *version,
+                        size_t version_size)
+{
+  char known[BLOCKCACHE_VERSION_SIZE], length[32];
+  version[0] = '\0';
+  t_chunk_buf *response_headers = new_download_buf();
+  if (!response_headers)
+    return 0;
+  char *encoded = curl_escape(path, 0);
+  int response = send_request("HEAD", encoded, NULL, response_headers, NULL, NULL, NULL);
+  curl_free(encoded);
+  int ok = response >= 200 && response < 300 &&
+           response_header(response_headers, "Content-Length", length, sizeof(length));
+  if (ok)
+    *size = strtoll(length, NULL, 10);
+  if (ok && blockcache_enabled() &&
+      (response_header(response_headers, "ETag", version, version_size) ||
+       response_header(response_headers, "Last-Modified", version, version_size)))
+    blockcache_set_version(path, version,
+                           blockcache_known_version(path, known, sizeof(known)) &&
+                           !strcmp(known, version));
+  free_download_buf(response_headers);
+  return ok;
+}
+
 int cloudfs_object_truncate(const char *path, off_t size)
 {
   char *encoded = curl_escape(path, 0);
   int response;
+  dedup_forget(path, 0);
   if (size == 0)
   {
     FILE *fp = fopen("/dev/null", "r");
-    response = send_request("PUT", encoded, fp, NULL, NULL);
+    response = send_request("PUT", encoded, fp, NULL, NULL, NULL, NULL);
     fclose(fp);
   }
   else
   {//TODO: this is busted
-    response = send_request("GET", encoded, NULL, NULL, NULL);
+    response = send_request("GET", encoded, NULL, NULL, NULL, NULL, NULL);
   }
   curl_free(encoded);
   return (response >= 200 && response < 300);
@@ -483,7 +1008,7 @@ int cloudfs_list_directory(const char *path, dir_entry **dir_list)
     curl_free(encoded_object);
   }
 
-  response = send_request("GET", container, NULL, xmlctx, NULL);
+  response = send_request("GET", container, NULL, NULL, xmlctx, NULL, NULL);
   xmlParseChunk(xmlctx, "", 0, 1);
   if (xmlctx->wellFormed && response >= 200 && response < 300)
   {
@@ -502,6 +1027,7 @@ int cloudfs_list_directory(const char *path, dir_entry **dir_list)
 
         dir_entry *de = (dir_entry *)malloc(sizeof(dir_entry));
         de->next = NULL;
+        de->prev = NULL;
         de->size = 0;
         de->last_modified = time(NULL);
         if (is_container || is_subdir)
@@ -586,7 +1112,8 @@ void cloudfs_free_dir_list(dir_entry *dir_list)
 int cloudfs_delete_object(const char *path)
 {
   char *encoded = curl_escape(path, 0);
-  int response = send_request("DELETE", encoded, NULL, NULL, NULL);
+  dedup_forget(path, 0);
+  int response = send_request("DELETE", encoded, NULL, NULL, NULL, NULL, NULL);
   curl_free(encoded);
   return (response >= 200 && response < 300);
 }
@@ -595,9 +1122,10 @@ int cloudfs_copy_object(const char *src, const char *dst)
 {
   char *dst_encoded = curl_escape(dst, 0);
   curl_slist *headers = NULL;
+  dedup_forget(dst, 0);
   add_header(&headers, "X-Copy-From", src);
   add_header(&headers, "Content-Length", "0");
-  int response = send_request("PUT", dst_encoded, NULL, NULL, headers);
+  int response = send_request("PUT", dst_encoded, NULL, NULL, NULL, NULL, headers);
   curl_free(dst_encoded);
   curl_slist_free_all(headers);
   return (response >= 200 && response < 300);
@@ -606,7 +1134,7 @@ int cloudfs_copy_object(const char *src, const char *dst)
 int cloudfs_create_directory(const char *path)
 {
   char *encoded = curl_escape(path, 0);
-  int response = send_request("MKDIR", encoded, NULL, NULL, NULL);
+  int response = send_request("MKDIR", encoded, NULL, NULL, NULL, NULL, NULL);
   curl_free(encoded);
   return (response >= 200 && response < 300);
 }
@@ -663,10 +1191,6 @@ int cloudfs_connect()
   char postdata[8192] = "";
   xmlNode *top_node = NULL, *service_node = NULL, *endpoint_node = NULL;
   xmlParserCtxtPtr xmlctx = NULL;
-  
-  if(!init_fifo()) {
-    return 0;
-  }
 
   pthread_mutex_lock(&pool_mut);
 
@@ -5,6 +5,8 @@
 #include <curl/easy.h>
 #include "fifo_ts.h"
 #include "compressapi.h"
+#include "chunkbuf.h"
+#include "bufpool.h"
 
 #define BUFFER_INITIAL_SIZE 4096
 #define MAX_HEADER_SIZE 8192
@@ -13,6 +15,8 @@
 #define USER_AGENT "CloudFuse"
 
 int NUM_THREADS;
+int COMPRESS_THREADS;
+int QUEUE_SIZE;
 
 typedef struct curl_slist curl_slist;
 
@@ -24,22 +28,47 @@ typedef struct dir_entry
   off_t size;
   time_t last_modified;
   int isdir;
-  struct dir_entry *next;
+  struct dir_entry *next, *prev;
 } dir_entry;
 
+#define CHUNK_DIRTY(map, i) ((map)[(i) / 8] & (1 << ((i) % 8)))
+#define SET_CHUNK_DIRTY(map, i) ((map)[(i) / 8] |= (1 << ((i) % 8)))
+
 typedef struct thread_pass {
-	char *data;
+  int fd;
+  const unsigned char *dirty;
+  int dirty_blocks;
   const char *path;
+  const char *version;
 	int blocks;
-	long size;
+	off_t size;
+  int next_block;
+  t_fifo *fifo;
 } t_thread_pass;
 
+typedef struct stream_upload {
+  char *path;
+  int fd;
+  t_fifo *fifo;
+  pthread_t thread;
+  int result;
+} t_stream_upload;
+
 void cloudfs_init();
 void cloudfs_set_credentials(char *username, char *tenant, char *password,
                              char *authurl, char *region, int use_snet);
 int cloufds_connect();
-int cloudfs_object_read_fp(const char *path, FILE *fp);
-int cloudfs_object_write_fp(const char *path, FILE *fp);
+int cloudfs_object_read_fp(const char *path, FILE *fp,
+                           const unsigned char *dirty, int dirty_blocks);
+int cloudfs_object_write_fp(const char *path, FILE *fp, off_t size,
+                            const char *version);
+ssize_t cloudfs_object_read_chunk(const char *path, int index, int fd, off_t offset,
+                                  const char *version);
+int cloudfs_object_info(const char *path, off_t *size, char *version,
+                        size_t version_size);
+t_stream_upload *cloudfs_stream_begin(const char *path, int fd);
+void cloudfs_stream_chunk(t_stream_upload *stream, int index);
+int cloudfs_stream_end(t_stream_upload *stream);
 int cloudfs_list_directory(const char *path, dir_entry **);
 int cloudfs_delete_object(const char *path);
 int cloudfs_copy_object(const char *src, const char *dst);
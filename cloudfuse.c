@@ -15,28 +15,119 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "cloudfsapi.h"
+#include "writeback.h"
+#include "readahead.h"
+#include "blockcache.h"
+#include "hashtable.h"
 #include "config.h"
 
 
 #define OPTION_SIZE 1024
+#define STATS_XATTR "user.cloudfuse.stats"
 
 static int cache_timeout;
+static int stream_writes;
+static int chunk_reads;
+static size_t dir_cache_max_bytes;
+static size_t dir_cache_max_entries;
 
 typedef struct dir_cache
 {
   char *path;
   dir_entry *entries;
+  t_hash_table *index;
   time_t cached;
+  int referenced;
+  size_t bytes;
+  size_t count;
   struct dir_cache *next, *prev;
 } dir_cache;
-static dir_cache *dcache;
-static pthread_mutex_t dmut;
+static dir_cache *dcache, *dcache_tail;
+static t_hash_table *dcache_index;
+static size_t dcache_bytes;
+static size_t dcache_entries;
+static size_t dcache_listings;
+static size_t dcache_evictions;
+static pthread_rwlock_t dlock;
 
-typedef struct
+/* A change made locally to a directory while its listing is fetched. */
+typedef struct listing_update
+{
+  char *path;
+  off_t size;
+  int isdir;
+  int removed;
+  struct listing_update *next;
+} listing_update;
+
+/*
+ * A directory listing being fetched from the store. The store may not
+ * know yet about changes made locally in the meantime, such as a file
+ * created but not yet uploaded, so they are kept in order to be applied
+ * again on top of the fetched listing. A directory removed meanwhile is
+ * not cached at all.
+ */
+typedef struct listing
+{
+  char *path;
+  int done;
+  int ok;
+  int waiters;
+  int dropped;
+  listing_update *updates, *updates_tail;
+  struct listing *next;
+} listing;
+static listing *listings;
+static pthread_mutex_t lmut;
+static pthread_cond_t lcond;
+
+#define OPEN_LOADING 0
+#define OPEN_READY 1
+#define OPEN_FAILED 2
+
+typedef struct openfile
 {
+  char *path;
+  int refs;
+  int state;
+  int listed;
+  int write_only;
+  struct openfile *next, *prev;
   int fd;
-  int flags;
+  pthread_mutex_t lock;
+  unsigned char *dirty;
+  int dirty_blocks;
+  int base_blocks;
+  int modified;
+  off_t seq_pos;
+  int streamed;
+  int stream_first;
+  t_stream_upload *stream;
+  pthread_mutex_t fetch_lock;
+  pthread_cond_t fetched;
+  unsigned char *present;
+  unsigned char *fetching;
+  unsigned char *prefetched;
+  int fetches;
+  int fetching_object;
+  int remote_blocks;
+  off_t remote_size;
+  char *version;
 } openfile;
+static openfile *open_files;
+static pthread_mutex_t omut;
+static pthread_cond_t ocond;
+
+/* What each open of a file keeps to itself; the rest is shared. */
+typedef struct
+{
+  openfile *of;
+  int flags;
+  off_t ra_next;
+  int ra_chunk;
+  int ra_window;
+  int ra_issued;
+} filehandle;
 
 
 static void dir_for(const char *path, char *dir)
@@ -47,144 +138,889 @@ static void dir_for(const char *path, char *dir)
     *slash = '\0';
 }
 
+static size_t str_bytes(const char *str)
+{
+  return str ? strlen(str) + 1 : 0;
+}
+
+/*
+ * Memory held by a cached entry: the entry, its strings and its share
+ * of the listing's index, which has up to two buckets per entry.
+ */
+static size_t entry_bytes(dir_entry *de)
+{
+  return sizeof(dir_entry) + sizeof(t_hash_node) + 2 * sizeof(t_hash_node *) +
+         str_bytes(de->name) + str_bytes(de->full_name) + str_bytes(de->content_type);
+}
+
+static size_t cache_bytes(dir_cache *cw)
+{
+  return sizeof(dir_cache) + sizeof(t_hash_node) + str_bytes(cw->path);
+}
+
+static void account_entry(dir_cache *cw, dir_entry *de, int sign)
+{
+  size_t bytes = entry_bytes(de);
+  cw->bytes += sign * bytes;
+  cw->count += sign;
+  dcache_bytes += sign * bytes;
+  dcache_entries += sign;
+}
+
+/*
+ * Cached listings are found by directory path through dcache_index, and
+ * each keeps an index of its entries by full name, so that looking up,
+ * adding or dropping an entry does not walk the listing. The dcache
+ * list runs from the most to the least recently used listing. Called
+ * with dlock held for writing.
+ */
 static dir_cache *new_cache(const char *path)
 {
   dir_cache *cw = (dir_cache *)calloc(sizeof(dir_cache), 1);
   cw->path = strdup(path);
   cw->prev = NULL;
   cw->entries = NULL;
+  cw->index = new_hash_table(16);
   cw->cached = time(NULL);
   if (dcache)
     dcache->prev = cw;
+  else
+    dcache_tail = cw;
   cw->next = dcache;
+  hash_put(dcache_index, cw->path, cw);
+  dcache_bytes += cache_bytes(cw);
+  dcache_listings++;
   return (dcache = cw);
 }
 
-static int caching_list_directory(const char *path, dir_entry **list)
+static void unlink_cache(dir_cache *cw)
+{
+  if (cw->prev)
+    cw->prev->next = cw->next;
+  else
+    dcache = cw->next;
+  if (cw->next)
+    cw->next->prev = cw->prev;
+  else
+    dcache_tail = cw->prev;
+}
+
+static void free_cache(dir_cache *cw)
+{
+  hash_remove(dcache_index, cw->path);
+  unlink_cache(cw);
+  dcache_bytes -= cache_bytes(cw) + cw->bytes;
+  dcache_entries -= cw->count;
+  dcache_listings--;
+  cloudfs_free_dir_list(cw->entries);
+  free_hash_table(cw->index);
+  free(cw->path);
+  free(cw);
+}
+
+static int dcache_over_budget()
+{
+  return (dir_cache_max_bytes && dcache_bytes > dir_cache_max_bytes) ||
+         (dir_cache_max_entries && dcache_entries > dir_cache_max_entries);
+}
+
+/*
+ * Drops whole listings, least recently used first, until the cache fits
+ * dir_cache_max_bytes and dir_cache_max_entries. Hits run under the read
+ * lock, so they only set referenced; a referenced listing reaching the
+ * tail is given a second chance at the head rather than dropped. keep,
+ * the listing just filled, is never dropped.
+ */
+static void evict_dirs(dir_cache *keep)
 {
-  pthread_mutex_lock(&dmut);
-  if (!strcmp(path, "/"))
-    path = "";
   dir_cache *cw;
-  for (cw = dcache; cw; cw = cw->next)
-    if (!strcmp(cw->path, path))
+  while (dcache_over_budget())
+  {
+    cw = dcache_tail == keep ? keep->prev : dcache_tail;
+    if (!cw)
       break;
-  if (!cw)
+    if (__atomic_exchange_n(&cw->referenced, 0, __ATOMIC_RELAXED))
+    {
+      unlink_cache(cw);
+      cw->prev = NULL;
+      cw->next = dcache;
+      if (dcache)
+        dcache->prev = cw;
+      else
+        dcache_tail = cw;
+      dcache = cw;
+      continue;
+    }
+    free_cache(cw);
+    dcache_evictions++;
+  }
+}
+
+/* Replaces the listing of cw with list. */
+static void set_entries(dir_cache *cw, dir_entry *list)
+{
+  dir_entry *de, *prev = NULL;
+  cloudfs_free_dir_list(cw->entries);
+  free_hash_table(cw->index);
+  dcache_bytes -= cw->bytes;
+  dcache_entries -= cw->count;
+  cw->bytes = cw->count = 0;
+  cw->index = new_hash_table(16);
+  cw->entries = list;
+  for (de = list; de; prev = de, de = de->next)
+  {
+    de->prev = prev;
+    hash_put(cw->index, de->full_name, de);
+    account_entry(cw, de, 1);
+  }
+}
+
+static void add_entry(dir_cache *cw, dir_entry *de)
+{
+  de->prev = NULL;
+  de->next = cw->entries;
+  if (cw->entries)
+    cw->entries->prev = de;
+  cw->entries = de;
+  hash_put(cw->index, de->full_name, de);
+  account_entry(cw, de, 1);
+}
+
+static void remove_entry(dir_cache *cw, dir_entry *de)
+{
+  account_entry(cw, de, -1);
+  hash_remove(cw->index, de->full_name);
+  if (de->prev)
+    de->prev->next = de->next;
+  else
+    cw->entries = de->next;
+  if (de->next)
+    de->next->prev = de->prev;
+  de->next = NULL;
+  cloudfs_free_dir_list(de);
+}
+
+static dir_entry *new_dir_entry(const char *dir, const char *path, off_t size, int isdir)
+{
+  dir_entry *de = (dir_entry *)malloc(sizeof(dir_entry));
+  de->size = size;
+  de->isdir = isdir;
+  de->name = strdup(&path[strlen(dir)+1]);
+  de->full_name = strdup(path);
+  de->content_type = strdup(isdir ? "application/directory" : "application/octet-stream");
+  de->last_modified = time(NULL);
+  de->next = NULL;
+  de->prev = NULL;
+  return de;
+}
+
+static void overlay_pending(const char *path, off_t size, void *data)
+{
+  dir_cache *cw = (dir_cache *)data;
+  char dir[MAX_PATH_SIZE];
+  dir_entry *de;
+  dir_for(path, dir);
+  if (strcmp(dir, cw->path))
+    return;
+  if ((de = (dir_entry *)hash_get(cw->index, path)))
+    de->size = size;
+  else
+    add_entry(cw, new_dir_entry(cw->path, path, size, 0));
+}
+
+/*
+ * A fresh listing does not know about uploads still waiting in the
+ * write-back queue, so their sizes are laid over it.
+ */
+static void overlay_writeback(dir_cache *cw)
+{
+  writeback_foreach(overlay_pending, cw);
+}
+
+/*
+ * Records a local change to path, in directory dir, for a listing of
+ * dir in flight; with no path, dir itself was removed. Called with
+ * dlock held for writing.
+ */
+static void note_update(const char *dir, const char *path, off_t size, int isdir, int removed)
+{
+  listing *l;
+  pthread_mutex_lock(&lmut);
+  for (l = listings; l && strcmp(l->path, dir); l = l->next);
+  if (l && !path)
+    l->dropped = 1;
+  else if (l)
   {
-    if (!cloudfs_list_directory(path, list))
-      return  0;
-    cw = new_cache(path);
+    listing_update *u = (listing_update *)calloc(1, sizeof(listing_update));
+    u->path = strdup(path);
+    u->size = size;
+    u->isdir = isdir;
+    u->removed = removed;
+    if (l->updates_tail)
+      l->updates_tail->next = u;
+    else
+      l->updates = u;
+    l->updates_tail = u;
   }
-  else if (cache_timeout > 0 && (time(NULL) - cw->cached > cache_timeout))
+  pthread_mutex_unlock(&lmut);
+}
+
+/*
+ * Applies the changes noted while l was fetched to its listing, cw, and
+ * stops noting them, as from now on they go to cw directly. Called with
+ * dlock held for writing.
+ */
+static void replay_updates(listing *l, dir_cache *cw)
+{
+  listing_update *u, *next;
+  dir_entry *de;
+  pthread_mutex_lock(&lmut);
+  for (u = l->updates; u; u = next)
+  {
+    next = u->next;
+    de = cw ? (dir_entry *)hash_get(cw->index, u->path) : NULL;
+    if (u->removed && de)
+      remove_entry(cw, de);
+    else if (!u->removed && de)
+      de->size = u->size;
+    else if (!u->removed && cw)
+      add_entry(cw, new_dir_entry(cw->path, u->path, u->size, u->isdir));
+    free(u->path);
+    free(u);
+  }
+  l->updates = l->updates_tail = NULL;
+  listing **link;
+  for (link = &listings; *link != l; link = &(*link)->next);
+  *link = l->next;
+  pthread_mutex_unlock(&lmut);
+}
+
+/*
+ * Lists path from the store into the cache. Callers arriving while a
+ * listing of the same path is in flight wait for it and share its
+ * outcome instead of sending their own. No lock on the cache is held
+ * meanwhile, so other directories stay usable.
+ */
+static int fetch_listing(const char *path)
+{
+  listing *l;
+  dir_entry *list;
+  pthread_mutex_lock(&lmut);
+  for (l = listings; l && strcmp(l->path, path); l = l->next);
+  if (l)
   {
-    if (!cloudfs_list_directory(path, list))
-      return  0;
-    cloudfs_free_dir_list(cw->entries);
+    l->waiters++;
+    while (!l->done)
+      pthread_cond_wait(&lcond, &lmut);
+    int ok = l->ok;
+    if (!--l->waiters)
+    {
+      free(l->path);
+      free(l);
+    }
+    pthread_mutex_unlock(&lmut);
+    return ok;
+  }
+  l = (listing *)calloc(1, sizeof(listing));
+  l->path = strdup(path);
+  l->waiters = 1;
+  l->next = listings;
+  listings = l;
+  pthread_mutex_unlock(&lmut);
+
+  int ok = cloudfs_list_directory(path, &list);
+  pthread_rwlock_wrlock(&dlock);
+  dir_cache *cw = NULL;
+  if (ok && l->dropped)
+    cloudfs_free_dir_list(list);
+  else if (ok)
+  {
+    if (!(cw = (dir_cache *)hash_get(dcache_index, path)))
+      cw = new_cache(path);
     cw->cached = time(NULL);
+    set_entries(cw, list);
+  }
+  replay_updates(l, cw);
+  if (cw)
+  {
+    overlay_writeback(cw);
+    evict_dirs(cw);
+  }
+  pthread_rwlock_unlock(&dlock);
+
+  pthread_mutex_lock(&lmut);
+  l->done = 1;
+  l->ok = ok;
+  pthread_cond_broadcast(&lcond);
+  if (!--l->waiters)
+  {
+    free(l->path);
+    free(l);
+  }
+  pthread_mutex_unlock(&lmut);
+  return ok;
+}
+
+/*
+ * Finds the listing of path, fetching it if it is not cached or has
+ * expired. On success it returns with dlock held for reading, so that
+ * the entries stay valid until the caller releases it.
+ */
+static int caching_list_directory(const char *path, dir_entry **list)
+{
+  int fetched = 0;
+  if (!strcmp(path, "/"))
+    path = "";
+  while (1)
+  {
+    pthread_rwlock_rdlock(&dlock);
+    dir_cache *cw = (dir_cache *)hash_get(dcache_index, path);
+    if (cw && (fetched || cache_timeout <= 0 || time(NULL) - cw->cached <= cache_timeout))
+    {
+      __atomic_store_n(&cw->referenced, 1, __ATOMIC_RELAXED);
+      *list = cw->entries;
+      return 1;
+    }
+    pthread_rwlock_unlock(&dlock);
+    if (!fetch_listing(path))
+      return 0;
+    fetched = 1;
   }
-  else
-    *list = cw->entries;
-  cw->entries = *list;
-  pthread_mutex_unlock(&dmut);
-  return 1;
 }
 
 static void update_dir_cache(const char *path, off_t size, int isdir)
 {
-  pthread_mutex_lock(&dmut);
+  pthread_rwlock_wrlock(&dlock);
   dir_cache *cw;
   dir_entry *de;
   char dir[MAX_PATH_SIZE];
   dir_for(path, dir);
-  for (cw = dcache; cw; cw = cw->next)
+  if ((cw = (dir_cache *)hash_get(dcache_index, dir)))
   {
-    if (!strcmp(cw->path, dir))
-    {
-      for (de = cw->entries; de; de = de->next)
-      {
-        if (!strcmp(de->full_name, path))
-        {
-          de->size = size;
-          pthread_mutex_unlock(&dmut);
-          return;
-        }
-      }
-      de = (dir_entry *)malloc(sizeof(dir_entry));
+    if ((de = (dir_entry *)hash_get(cw->index, path)))
       de->size = size;
-      de->isdir = isdir;
-      de->name = strdup(&path[strlen(cw->path)+1]);
-      de->full_name = strdup(path);
-      de->content_type = strdup(isdir ? "application/directory" : "application/octet-stream");
-      de->last_modified = time(NULL);
-      de->next = cw->entries;
-      cw->entries = de;
-      if (isdir)
+    else
+    {
+      add_entry(cw, new_dir_entry(cw->path, path, size, isdir));
+      if (isdir && !hash_get(dcache_index, path))
         new_cache(path);
-      break;
+      evict_dirs(cw);
     }
   }
-  pthread_mutex_unlock(&dmut);
+  note_update(dir, path, size, isdir, 0);
+  pthread_rwlock_unlock(&dlock);
 }
 
 static void dir_decache(const char *path)
 {
   dir_cache *cw;
-  pthread_mutex_lock(&dmut);
-  dir_entry *de, *tmpde;
+  dir_entry *de;
   char dir[MAX_PATH_SIZE];
+  pthread_rwlock_wrlock(&dlock);
   dir_for(path, dir);
-  for (cw = dcache; cw; cw = cw->next)
+  if ((cw = (dir_cache *)hash_get(dcache_index, path)))
+    free_cache(cw);
+  if ((cw = (dir_cache *)hash_get(dcache_index, dir)) &&
+      (de = (dir_entry *)hash_get(cw->index, path)))
+    remove_entry(cw, de);
+  note_update(path, NULL, 0, 0, 1);
+  note_update(dir, path, 0, 0, 1);
+  pthread_rwlock_unlock(&dlock);
+}
+
+/*
+ * Looks path up in its directory's listing. The attributes are copied
+ * to info, as the cached entry may be replaced once dlock is released,
+ * and info is returned, or NULL if there is no such entry.
+ */
+static dir_entry *path_info(const char *path, dir_entry *info)
+{
+  char dir[MAX_PATH_SIZE];
+  dir_for(path, dir);
+  dir_entry *tmp;
+  if (!caching_list_directory(dir, &tmp))
+    return NULL;
+  dir_cache *cw = (dir_cache *)hash_get(dcache_index, dir);
+  tmp = cw ? (dir_entry *)hash_get(cw->index, path) : NULL;
+  if (tmp)
+  {
+    *info = *tmp;
+    info->name = info->full_name = info->content_type = NULL;
+    info->next = info->prev = NULL;
+  }
+  pthread_rwlock_unlock(&dlock);
+  return tmp ? info : NULL;
+}
+
+static int blocks_for(off_t size)
+{
+  return (size + CHUNK - 1) / CHUNK;
+}
+
+static openfile *new_openfile(const char *path)
+{
+  openfile *of = (openfile *)calloc(1, sizeof(openfile));
+  of->path = strdup(path);
+  of->refs = 1;
+  of->fd = -1;
+  pthread_mutex_init(&of->lock, NULL);
+  pthread_mutex_init(&of->fetch_lock, NULL);
+  pthread_cond_init(&of->fetched, NULL);
+  return of;
+}
+
+/*
+ * Gives an open file its local copy, fd, which holds remote_size bytes
+ * of the object. Each open file tracks which CHUNK-sized pieces it has
+ * changed since the last flush. Chunks below base_blocks are known to be
+ * stored remotely, so only the dirty ones among them have to be
+ * uploaded again.
+ */
+static void set_backing(openfile *of, int fd, off_t remote_size, int modified)
+{
+  of->fd = fd;
+  of->base_blocks = blocks_for(remote_size);
+  of->modified = modified;
+  of->seq_pos = remote_size;
+  of->streamed = remote_size / CHUNK;
+}
+
+static filehandle *new_filehandle(openfile *of, int flags)
+{
+  filehandle *fh = (filehandle *)calloc(1, sizeof(filehandle));
+  fh->of = of;
+  fh->flags = flags;
+  fh->ra_chunk = -1;
+  fh->ra_issued = -1;
+  return fh;
+}
+
+/*
+ * Counts the chunks from first on that were fetched ahead and never
+ * read. Called with fetch_lock held.
+ */
+static void count_wasted(openfile *of, int first)
+{
+  int i;
+  for (i = first; i < of->remote_blocks; i++)
   {
-    if (!strcmp(cw->path, path))
+    if (!CHUNK_DIRTY(of->prefetched, i))
+      continue;
+    of->prefetched[i / 8] &= ~(1 << (i % 8));
+    off_t begin = (off_t)i * CHUNK;
+    readahead_wasted(of->remote_size - begin < CHUNK ? of->remote_size - begin : CHUNK);
+  }
+}
+
+static void free_openfile(openfile *of)
+{
+  if (of->stream)
+    cloudfs_stream_end(of->stream);
+  if (of->present)
+  {
+    readahead_cancel(of);
+    count_wasted(of, 0);
+  }
+  if (of->fd >= 0)
+    close(of->fd);
+  pthread_mutex_destroy(&of->lock);
+  pthread_mutex_destroy(&of->fetch_lock);
+  pthread_cond_destroy(&of->fetched);
+  free(of->dirty);
+  free(of->present);
+  free(of->fetching);
+  free(of->prefetched);
+  free(of->version);
+  free(of->path);
+  free(of);
+}
+
+/*
+ * Opens of one path share an openfile, and with it one local copy and
+ * one download, through the open_files table. An entry is counted by
+ * the handles using it. Unlinking, renaming or recreating the path takes
+ * it out of the table, so that later opens start afresh, and it lives
+ * on until its last handle is released. Called with omut held.
+ */
+static openfile *find_openfile(const char *path)
+{
+  openfile *of;
+  for (of = open_files; of; of = of->next)
+    if (!strcmp(of->path, path))
+      return of;
+  return NULL;
+}
+
+static void list_openfile(openfile *of)
+{
+  of->prev = NULL;
+  of->next = open_files;
+  if (open_files)
+    open_files->prev = of;
+  open_files = of;
+  of->listed = 1;
+}
+
+static void unlist_openfile(openfile *of)
+{
+  if (!of->listed)
+    return;
+  if (of->prev)
+    of->prev->next = of->next;
+  else
+    open_files = of->next;
+  if (of->next)
+    of->next->prev = of->prev;
+  of->listed = 0;
+}
+
+static void forget_openfile(const char *path)
+{
+  pthread_mutex_lock(&omut);
+  openfile *of = find_openfile(path);
+  if (of)
+    unlist_openfile(of);
+  pthread_mutex_unlock(&omut);
+}
+
+static void put_openfile(openfile *of)
+{
+  pthread_mutex_lock(&omut);
+  int last = !--of->refs;
+  if (last)
+    unlist_openfile(of);
+  pthread_mutex_unlock(&omut);
+  if (last)
+    free_openfile(of);
+}
+
+static void mark_dirty(openfile *of, int first, int last)
+{
+  int i;
+  pthread_mutex_lock(&of->lock);
+  if (last >= of->dirty_blocks)
+  {
+    int bytes = (of->dirty_blocks + 7) / 8;
+    int new_blocks = (last + 1) * 2;
+    of->dirty = (unsigned char *)realloc(of->dirty, (new_blocks + 7) / 8);
+    memset(of->dirty + bytes, 0, (new_blocks + 7) / 8 - bytes);
+    of->dirty_blocks = new_blocks;
+  }
+  for (i = first; i <= last; i++)
+    SET_CHUNK_DIRTY(of->dirty, i);
+  of->modified = 1;
+  pthread_mutex_unlock(&of->lock);
+}
+
+/*
+ * Returns the set of chunks a flush of a blocks-long file has to upload
+ * and clears the file's dirty state, or NULL if nothing changed.
+ */
+static unsigned char *take_dirty(openfile *of, int blocks)
+{
+  unsigned char *dirty = NULL;
+  int i;
+  pthread_mutex_lock(&of->lock);
+  if (of->modified)
+  {
+    dirty = (unsigned char *)calloc((blocks + 7) / 8 + 1, 1);
+    for (i = 0; i < blocks; i++)
+      if (i >= of->base_blocks || (i < of->dirty_blocks && CHUNK_DIRTY(of->dirty, i)))
+        SET_CHUNK_DIRTY(dirty, i);
+    if (of->dirty)
+      memset(of->dirty, 0, (of->dirty_blocks + 7) / 8);
+    of->modified = 0;
+  }
+  pthread_mutex_unlock(&of->lock);
+  return dirty;
+}
+
+static void restore_dirty(openfile *of, unsigned char *dirty, int blocks)
+{
+  int i;
+  for (i = 0; i < blocks; i++)
+    if (CHUNK_DIRTY(dirty, i))
+      mark_dirty(of, i, i);
+  pthread_mutex_lock(&of->lock);
+  of->modified = 1;
+  pthread_mutex_unlock(&of->lock);
+}
+
+/*
+ * Called by write-back when uploads of path have failed for good, with
+ * the chunks they did not store (all of them if blocks is -1). They are
+ * marked dirty again on the open file, which still holds them, so that
+ * its next flush sends them; nothing else is let through until then.
+ * An open file still loading came after the failed uploads and only has
+ * what the object held before them.
+ */
+static void writeback_failed(const char *path, const unsigned char *dirty, int blocks)
+{
+  pthread_mutex_lock(&omut);
+  openfile *of = find_openfile(path);
+  if (of && of->state == OPEN_READY)
+    of->refs++;
+  else
+    of = NULL;
+  pthread_mutex_unlock(&omut);
+  if (!of)
+    return;
+  if (dirty)
+    restore_dirty(of, (unsigned char *)dirty, blocks);
+  else if ((blocks = blocks_for(cloudfs_file_size(of->fd))) > 0)
+    mark_dirty(of, 0, blocks - 1);
+  put_openfile(of);
+}
+
+/*
+ * While a handle is only ever written at its end, every chunk the writer
+ * moves past is complete and is handed to a streaming upload straight
+ * away. Streamed chunks count as stored: their dirty bits are cleared so
+ * that the flush only sends the tail and the manifest, and any later
+ * write to one of them sets its bit again. No stream is started while
+ * background uploads of the path are pending, as an older snapshot
+ * would land on top of the chunks streamed after it; those chunks stay
+ * dirty and go out with the next flush.
+ */
+static void stream_written(openfile *of, const char *path, off_t offset, int written)
+{
+  int i, first, complete;
+  pthread_mutex_lock(&of->lock);
+  if (offset != of->seq_pos)
+  {
+    of->seq_pos = -1;
+    pthread_mutex_unlock(&of->lock);
+    return;
+  }
+  of->seq_pos += written;
+  complete = of->seq_pos / CHUNK;
+  first = of->streamed;
+  if (complete > first && !of->stream)
+  {
+    if (!writeback_idle(path) ||
+        !(of->stream = cloudfs_stream_begin(path, of->fd)))
     {
-      if (cw == dcache)
-        dcache = cw->next;
-      if (cw->prev)
-        cw->prev->next = cw->next;
-      if (cw->next)
-        cw->next->prev = cw->prev;
-      cloudfs_free_dir_list(cw->entries);
-      free(cw->path);
-      free(cw);
+      pthread_mutex_unlock(&of->lock);
+      return;
     }
-    else if (cw->entries && !strcmp(dir, cw->path))
+    of->stream_first = first;
+  }
+  for (i = first; i < complete; i++)
+  {
+    if (i < of->dirty_blocks)
+      of->dirty[i / 8] &= ~(1 << (i % 8));
+    if (i >= of->base_blocks)
+      of->base_blocks = i + 1;
+  }
+  if (complete > first)
+    of->streamed = complete;
+  t_stream_upload *stream = of->stream;
+  pthread_mutex_unlock(&of->lock);
+  for (i = first; i < complete; i++)
+    cloudfs_stream_chunk(stream, i);
+}
+
+/*
+ * Waits for the streaming upload, if any. Chunks it failed to store are
+ * marked dirty again so that the flush sends them.
+ */
+static void finish_stream(openfile *of)
+{
+  pthread_mutex_lock(&of->lock);
+  t_stream_upload *stream = of->stream;
+  int first = of->stream_first, last = of->streamed - 1;
+  of->stream = NULL;
+  pthread_mutex_unlock(&of->lock);
+  if (stream && !cloudfs_stream_end(stream))
+    mark_dirty(of, first, last);
+}
+
+/*
+ * Handles opened with chunk_reads start out as a sparse file of the
+ * remote size, and the chunks below remote_blocks are downloaded the
+ * first time a read or a partial write touches them.
+ */
+static int fetch_chunk(openfile *of, const char *path, int i)
+{
+  off_t begin = (off_t)i * CHUNK;
+  off_t length = of->remote_size - begin < CHUNK ? of->remote_size - begin : CHUNK;
+  if (cloudfs_object_read_chunk(path, i, of->fd, begin, of->version) == length)
+    return 1;
+  debugf("chunk %d of %s could not be fetched", i, path);
+  return 0;
+}
+
+/*
+ * Falls back to downloading the whole object, for objects that cannot be
+ * read by chunk. Only possible while the handle holds no changes. Called
+ * with fetch_lock held and no chunk fetches running; the lock is dropped
+ * for the download, during which fetching_object makes every read and
+ * write wait for it, including writes past the remote size.
+ */
+static int fetch_object(openfile *of, const char *path)
+{
+  int i, blocks = of->remote_blocks;
+  pthread_mutex_lock(&of->lock);
+  int modified = of->modified;
+  pthread_mutex_unlock(&of->lock);
+  if (modified)
+    return 0;
+  for (i = 0; i < blocks; i++)
+    SET_CHUNK_DIRTY(of->fetching, i);
+  of->fetches++;
+  of->fetching_object = 1;
+  pthread_mutex_unlock(&of->fetch_lock);
+  writeback_wait(path);
+  FILE *fp = fdopen(dup(of->fd), "w+");
+  if (fp)
+    rewind(fp);
+  int ok = fp && cloudfs_object_write_fp(path, fp, of->remote_size, of->version);
+  if (fp)
+    fclose(fp);
+  pthread_mutex_lock(&of->fetch_lock);
+  for (i = 0; i < blocks; i++)
+    of->fetching[i / 8] &= ~(1 << (i % 8));
+  of->fetches--;
+  of->fetching_object = 0;
+  if (ok)
+  {
+    count_wasted(of, 0);
+    of->remote_blocks = 0;
+  }
+  pthread_cond_broadcast(&of->fetched);
+  return ok;
+}
+
+/*
+ * Downloads chunk i without holding fetch_lock, so that chunks of one
+ * handle can be fetched side by side. The chunk is flagged in fetching
+ * meanwhile; anyone else needing it waits on the fetched condition.
+ * Called with fetch_lock held, and returns with it held.
+ */
+static int fetch_unlocked(openfile *of, const char *path, int i)
+{
+  SET_CHUNK_DIRTY(of->fetching, i);
+  of->fetches++;
+  pthread_mutex_unlock(&of->fetch_lock);
+  int ok = fetch_chunk(of, path, i);
+  pthread_mutex_lock(&of->fetch_lock);
+  of->fetching[i / 8] &= ~(1 << (i % 8));
+  of->fetches--;
+  if (ok)
+    SET_CHUNK_DIRTY(of->present, i);
+  pthread_cond_broadcast(&of->fetched);
+  return ok;
+}
+
+/*
+ * Makes sure the chunks under [offset, offset + length) are local. A
+ * write passes overwrite, so that chunks it covers completely are not
+ * downloaded only to be replaced. A write also marks the file modified
+ * up front, so that no whole-object download starts, and rewrites the
+ * file under it, between here and the write itself.
+ */
+static int fetch_range(openfile *of, const char *path, off_t offset, size_t length, int overwrite)
+{
+  int i, ok = 1;
+  if (!of->present || !length)
+    return 1;
+  pthread_mutex_lock(&of->fetch_lock);
+  if (overwrite)
+  {
+    while (of->fetching_object)
+      pthread_cond_wait(&of->fetched, &of->fetch_lock);
+    pthread_mutex_lock(&of->lock);
+    of->modified = 1;
+    pthread_mutex_unlock(&of->lock);
+  }
+  int last = (offset + length - 1) / CHUNK;
+  for (i = offset / CHUNK; i <= last; i++)
+  {
+    while (of->fetching_object || (i < of->remote_blocks && CHUNK_DIRTY(of->fetching, i)))
+      pthread_cond_wait(&of->fetched, &of->fetch_lock);
+    if (i >= of->remote_blocks)
+      break;
+    if (CHUNK_DIRTY(of->present, i))
     {
-      if (!strcmp(cw->entries->full_name, path))
+      if (CHUNK_DIRTY(of->prefetched, i))
       {
-        de = cw->entries;
-        cw->entries = de->next;
-        de->next = NULL;
-        cloudfs_free_dir_list(de);
-      }
-      else for (de = cw->entries; de->next; de = de->next)
-      {
-        if (!strcmp(de->next->full_name, path))
-        {
-          tmpde = de->next;
-          de->next = de->next->next;
-          tmpde->next = NULL;
-          cloudfs_free_dir_list(tmpde);
-          break;
-        }
+        of->prefetched[i / 8] &= ~(1 << (i % 8));
+        readahead_hit();
       }
+      continue;
+    }
+    off_t begin = (off_t)i * CHUNK;
+    off_t end = of->remote_size - begin < CHUNK ? of->remote_size : begin + CHUNK;
+    if (overwrite && offset <= begin && offset + (off_t)length >= end)
+      SET_CHUNK_DIRTY(of->present, i);
+    else if (!fetch_unlocked(of, path, i))
+    {
+      /* the whole object is rewritten, so nothing else may be writing */
+      while (of->fetches)
+        pthread_cond_wait(&of->fetched, &of->fetch_lock);
+      ok = of->remote_blocks == 0 || fetch_object(of, path);
+      break;
     }
   }
-  pthread_mutex_unlock(&dmut);
+  pthread_mutex_unlock(&of->fetch_lock);
+  return ok;
 }
 
-static dir_entry *path_info(const char *path)
+/*
+ * Worker side of read_ahead(). A chunk that has meanwhile been read,
+ * written or truncated away is left alone.
+ */
+static int prefetch_chunk(void *owner, const char *path, int i)
 {
-  char dir[MAX_PATH_SIZE];
-  dir_for(path, dir);
-  dir_entry *tmp;
-  if (!caching_list_directory(dir, &tmp))
-    return NULL;
-  for (; tmp; tmp = tmp->next)
+  openfile *of = (openfile *)owner;
+  int ok = 0;
+  pthread_mutex_lock(&of->fetch_lock);
+  if (i < of->remote_blocks && !CHUNK_DIRTY(of->present, i) &&
+      !CHUNK_DIRTY(of->fetching, i) && (ok = fetch_unlocked(of, path, i)))
+    SET_CHUNK_DIRTY(of->prefetched, i);
+  pthread_mutex_unlock(&of->fetch_lock);
+  return ok;
+}
+
+/*
+ * Sequential reads are detected per handle. Each read that carries on
+ * where the last one ended and moves into a new chunk doubles the
+ * window, up to READAHEAD chunks, and the chunks within the window past
+ * the read are requested in the background. Any other read closes the
+ * window again.
+ */
+static void read_ahead(filehandle *fh, const char *path, off_t offset, size_t size)
+{
+  openfile *of = fh->of;
+  int i;
+  if (!of->present || !READAHEAD || !size)
+    return;
+  pthread_mutex_lock(&of->fetch_lock);
+  int last = (offset + size - 1) / CHUNK;
+  if (offset != fh->ra_next)
   {
-    if (!strcmp(tmp->full_name, path))
-      return tmp;
+    fh->ra_window = 0;
+    fh->ra_issued = last;
   }
-  return NULL;
+  else if (last > fh->ra_chunk)
+    fh->ra_window = fh->ra_window ? fh->ra_window * 2 : 1;
+  if (fh->ra_window > READAHEAD)
+    fh->ra_window = READAHEAD;
+  fh->ra_next = offset + size;
+  fh->ra_chunk = last;
+  int first = fh->ra_issued > last ? fh->ra_issued + 1 : last + 1;
+  int end = last + fh->ra_window;
+  if (end >= of->remote_blocks)
+    end = of->remote_blocks - 1;
+  /* a request dropped on a full queue is made again by the next read */
+  for (i = first; i <= end; i++)
+  {
+    if (!CHUNK_DIRTY(of->present, i) && !CHUNK_DIRTY(of->fetching, i) &&
+        !readahead_request(of, path, i))
+      break;
+    fh->ra_issued = i;
+  }
+  pthread_mutex_unlock(&of->fetch_lock);
 }
 
 static int cfs_getattr(const char *path, struct stat *stbuf)
@@ -197,7 +1033,7 @@ static int cfs_getattr(const char *path, struct stat *stbuf)
     stbuf->st_nlink = 2;
     return 0;
   }
-  dir_entry *de = path_info(path);
+  dir_entry info, *de = path_info(path, &info);
   if (!de)
     return -ENOENT;
   stbuf->st_ctime = stbuf->st_mtime = de->last_modified;
@@ -220,10 +1056,10 @@ static int cfs_getattr(const char *path, struct stat *stbuf)
 
 static int cfs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *info)
 {
-  openfile *of = (openfile *)(uintptr_t)info->fh;
-  if (of)
+  filehandle *fh = (filehandle *)(uintptr_t)info->fh;
+  if (fh)
   {
-    stbuf->st_size = cloudfs_file_size(of->fd);
+    stbuf->st_size = cloudfs_file_size(fh->of->fd);
     stbuf->st_mode = S_IFREG | 0666;
     stbuf->st_nlink = 1;
     return 0;
@@ -240,6 +1076,7 @@ static int cfs_readdir(const char *path, void *buf, fuse_fill_dir_t filldir, off
   filldir(buf, "..", NULL, 0);
   for (; de; de = de->next)
     filldir(buf, de->name, NULL, 0);
+  pthread_rwlock_unlock(&dlock);
   return 0;
 }
 
@@ -256,58 +1093,183 @@ static int cfs_mkdir(const char *path, mode_t mode)
 static int cfs_create(const char *path, mode_t mode, struct fuse_file_info *info)
 {
   FILE *temp_file = tmpfile();
-  openfile *of = (openfile *)malloc(sizeof(openfile));
-  of->fd = dup(fileno(temp_file));
+  openfile *of = new_openfile(path);
+  set_backing(of, dup(fileno(temp_file)), 0, 1);
+  of->state = OPEN_READY;
   fclose(temp_file);
-  of->flags = info->flags;
-  info->fh = (uintptr_t)of;
+  pthread_mutex_lock(&omut);
+  openfile *old = find_openfile(path);
+  if (old)
+    unlist_openfile(old);
+  list_openfile(of);
+  pthread_mutex_unlock(&omut);
+  info->fh = (uintptr_t)new_filehandle(of, info->flags);
   update_dir_cache(path, 0, 0);
   info->direct_io = 1;
   return 0;
 }
 
-static int cfs_open(const char *path, struct fuse_file_info *info)
+/*
+ * Sets up the local copy of a newly opened file, which is only done by
+ * the first of concurrent opens of the path.
+ */
+static int load_openfile(openfile *of, const char *path, int flags)
 {
   FILE *temp_file = tmpfile();
-  dir_entry *de = path_info(path);
-  if (!(info->flags & O_WRONLY))
+  dir_entry info, *de = path_info(path, &info);
+  if (!temp_file)
+    return -EIO;
+  if (!(flags & O_WRONLY))
   {
-    if (!cloudfs_object_write_fp(path, temp_file))
+    char version[BLOCKCACHE_VERSION_SIZE] = "";
+    off_t size = de && !de->isdir ? de->size : -1;
+    writeback_wait(path);
+    /* the listing may be older than the object; chunks past a stale
+       size would go unnoticed, so the size comes from a HEAD */
+    if (size >= 0 && !cloudfs_object_info(path, &size, version, sizeof(version)))
+      debugf("unable to look up the size of %s", path);
+    int versioned = version[0] != '\0';
+    if (chunk_reads && size >= 0 && !ftruncate(fileno(temp_file), size))
+    {
+      set_backing(of, dup(fileno(temp_file)), size, 0);
+      of->remote_size = size;
+      of->version = versioned ? strdup(version) : NULL;
+      of->remote_blocks = blocks_for(size);
+      of->present = (unsigned char *)calloc((of->remote_blocks + 7) / 8 + 1, 1);
+      of->fetching = (unsigned char *)calloc((of->remote_blocks + 7) / 8 + 1, 1);
+      of->prefetched = (unsigned char *)calloc((of->remote_blocks + 7) / 8 + 1, 1);
+      fclose(temp_file);
+      update_dir_cache(path, size, 0);
+      return 0;
+    }
+    if (!cloudfs_object_write_fp(path, temp_file, size, versioned ? version : NULL))
     {
       fclose(temp_file);
       return -ENOENT;
     }
-    update_dir_cache(path, (de ? de->size : 0), 0);
+    update_dir_cache(path, (size >= 0 ? size : 0), 0);
+    set_backing(of, dup(fileno(temp_file)), cloudfs_file_size(fileno(temp_file)), 0);
+  }
+  else
+  {
+    set_backing(of, dup(fileno(temp_file)), 0, 1);
+    of->write_only = 1;
   }
-  openfile *of = (openfile *)malloc(sizeof(openfile));
-  of->fd = dup(fileno(temp_file));
   fclose(temp_file);
-  of->flags = info->flags;
-  info->fh = (uintptr_t)of;
+  return 0;
+}
+
+/*
+ * Joins the open file already shared by other handles of path, waiting
+ * for it to finish loading if need be, or else loads it. A file first
+ * opened write-only was never downloaded and only holds what has been
+ * written to it, so a reader takes its place in the table with a copy
+ * of its own, leaving the writers theirs.
+ */
+static int cfs_open(const char *path, struct fuse_file_info *info)
+{
+  int ret = 0;
+  openfile *write_only = NULL;
+  pthread_mutex_lock(&omut);
+  openfile *of = find_openfile(path);
+  if (of)
+  {
+    of->refs++;
+    while (of->state == OPEN_LOADING)
+      pthread_cond_wait(&ocond, &omut);
+    if (of->state == OPEN_FAILED)
+      ret = -ENOENT;
+    else if (of->write_only && !(info->flags & O_WRONLY))
+    {
+      unlist_openfile(of);
+      write_only = of;
+      of = NULL;
+    }
+  }
+  int loader = !of;
+  if (loader)
+    list_openfile(of = new_openfile(path));
+  pthread_mutex_unlock(&omut);
+  if (write_only)
+    put_openfile(write_only);
+  if (loader)
+  {
+    ret = load_openfile(of, path, info->flags);
+    pthread_mutex_lock(&omut);
+    of->state = ret ? OPEN_FAILED : OPEN_READY;
+    if (ret)
+      unlist_openfile(of);
+    pthread_cond_broadcast(&ocond);
+    pthread_mutex_unlock(&omut);
+  }
+  if (ret)
+  {
+    put_openfile(of);
+    return ret;
+  }
+  info->fh = (uintptr_t)new_filehandle(of, info->flags);
   info->direct_io = 1;
   return 0;
 }
 
 static int cfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *info)
 {
-  return pread(((openfile *)(uintptr_t)info->fh)->fd, buf, size, offset);
+  filehandle *fh = (filehandle *)(uintptr_t)info->fh;
+  openfile *of = fh->of;
+  read_ahead(fh, path, offset, size);
+  if (!fetch_range(of, path, offset, size, 0))
+    return -EIO;
+  return pread(of->fd, buf, size, offset);
 }
 
 static int cfs_flush(const char *path, struct fuse_file_info *info)
 {
-  openfile *of = (openfile *)(uintptr_t)info->fh;
-  if (of)
+  filehandle *fh = (filehandle *)(uintptr_t)info->fh;
+  if (fh)
   {
-    update_dir_cache(path, cloudfs_file_size(of->fd), 0);
-    if (of->flags & O_RDWR || of->flags & O_WRONLY)
+    openfile *of = fh->of;
+    off_t size = cloudfs_file_size(of->fd);
+    update_dir_cache(path, size, 0);
+    if (fh->flags & O_RDWR || fh->flags & O_WRONLY)
     {
+      finish_stream(of);
+      int blocks = blocks_for(size);
+      unsigned char *dirty = take_dirty(of, blocks);
+      if (!dirty)
+        return 0;
+      if (WRITEBACK)
+      {
+        if (!writeback_enqueue(path, of->fd, size, dirty, blocks))
+        {
+          restore_dirty(of, dirty, blocks);
+          free(dirty);
+          return -EIO;
+        }
+        pthread_mutex_lock(&of->lock);
+        of->base_blocks = blocks;
+        pthread_mutex_unlock(&of->lock);
+        return 0;
+      }
+      if (!writeback_covers(path, dirty, blocks))
+      {
+        restore_dirty(of, dirty, blocks);
+        free(dirty);
+        return -EIO;
+      }
       FILE *fp = fdopen(dup(of->fd), "r");
       rewind(fp);
-      if (!cloudfs_object_read_fp(path, fp))
+      if (!cloudfs_object_read_fp(path, fp, dirty, blocks))
       {
+        restore_dirty(of, dirty, blocks);
+        free(dirty);
         fclose(fp);
         return -ENOENT;
       }
+      writeback_stored(path, dirty, blocks);
+      pthread_mutex_lock(&of->lock);
+      of->base_blocks = blocks;
+      pthread_mutex_unlock(&of->lock);
+      free(dirty);
       fclose(fp);
     }
   }
@@ -316,7 +1278,9 @@ static int cfs_flush(const char *path, struct fuse_file_info *info)
 
 static int cfs_release(const char *path, struct fuse_file_info *info)
 {
-  close(((openfile *)(uintptr_t)info->fh)->fd);
+  filehandle *fh = (filehandle *)(uintptr_t)info->fh;
+  put_openfile(fh->of);
+  free(fh);
   return 0;
 }
 
@@ -332,38 +1296,95 @@ static int cfs_rmdir(const char *path)
 
 static int cfs_ftruncate(const char *path, off_t size, struct fuse_file_info *info)
 {
-  openfile *of = (openfile *)(uintptr_t)info->fh;
+  openfile *of = ((filehandle *)(uintptr_t)info->fh)->of;
+  off_t old_size = cloudfs_file_size(of->fd);
+  off_t kept = size < old_size ? size : old_size;
+  if (kept % CHUNK && !fetch_range(of, path, kept, 1, 0))
+    return -EIO;
+  /* a fetch still landing would write past the new end */
+  pthread_mutex_lock(&of->fetch_lock);
+  while (of->fetches)
+    pthread_cond_wait(&of->fetched, &of->fetch_lock);
   if (ftruncate(of->fd, size))
+  {
+    pthread_mutex_unlock(&of->fetch_lock);
     return -errno;
+  }
+  if (of->remote_blocks > blocks_for(kept))
+  {
+    count_wasted(of, blocks_for(kept));
+    of->remote_blocks = blocks_for(kept);
+  }
+  pthread_mutex_unlock(&of->fetch_lock);
   lseek(of->fd, 0, SEEK_SET);
+  pthread_mutex_lock(&of->lock);
+  of->seq_pos = -1;
+  pthread_mutex_unlock(&of->lock);
+  if (size < old_size)
+  {
+    pthread_mutex_lock(&of->lock);
+    if (of->base_blocks > blocks_for(size))
+      of->base_blocks = blocks_for(size);
+    of->modified = 1;
+    pthread_mutex_unlock(&of->lock);
+    if (size % CHUNK)
+      mark_dirty(of, size / CHUNK, size / CHUNK);
+  }
+  else if (size > old_size)
+    mark_dirty(of, old_size / CHUNK, (size - 1) / CHUNK);
   update_dir_cache(path, size, 0);
   return 0;
 }
 
 static int cfs_write(const char *path, const char *buf, size_t length, off_t offset, struct fuse_file_info *info)
 {
+  openfile *of = ((filehandle *)(uintptr_t)info->fh)->of;
+  if (!fetch_range(of, path, offset, length, 1))
+    return -EIO;
   update_dir_cache(path, offset + length, 0);
-  return pwrite(((openfile *)(uintptr_t)info->fh)->fd, buf, length, offset);
+  int written = pwrite(of->fd, buf, length, offset);
+  if (written > 0)
+  {
+    mark_dirty(of, offset / CHUNK, (offset + written - 1) / CHUNK);
+    if (stream_writes)
+      stream_written(of, path, offset, written);
+  }
+  return written;
 }
 
 static int cfs_unlink(const char *path)
 {
+  forget_openfile(path);
+  writeback_wait(path);
   if (cloudfs_delete_object(path))
   {
+    writeback_forget(path);
     dir_decache(path);
     return 0;
   }
   return -ENOENT;
 }
 
+/*
+ * Sends anything not yet flushed, then waits until every upload of the
+ * file, including ones queued in the background, has been stored.
+ */
 static int cfs_fsync(const char *path, int idunno, struct fuse_file_info *info)
 {
+  int ret = cfs_flush(path, info);
+  if (ret)
+    return ret;
+  if (!writeback_wait(path))
+    return -EIO;
   return 0;
 }
 
 static int cfs_truncate(const char *path, off_t size)
 {
-  cloudfs_object_truncate(path, size);
+  forget_openfile(path);
+  writeback_wait(path);
+  if (cloudfs_object_truncate(path, size))
+    writeback_forget(path);
   return 0;
 }
 
@@ -393,26 +1414,84 @@ static int cfs_chmod(const char *path, mode_t mode)
 
 static int cfs_rename(const char *src, const char *dst)
 {
-  dir_entry *src_de = path_info(src);
+  dir_entry info, *src_de = path_info(src, &info);
   if (!src_de)
       return -ENOENT;
   if (src_de->isdir)
     return -EISDIR;
+  writeback_wait(src);
+  forget_openfile(dst);
   if (cloudfs_copy_object(src, dst))
   {
     /* FIXME this isn't quite right as doesn't preserve last modified */
+    writeback_forget(dst);
     update_dir_cache(dst, src_de->size, 0);
     return cfs_unlink(src);
   }
   return -EIO;
 }
 
+static int dir_cache_stats(char *out, size_t size)
+{
+  pthread_rwlock_rdlock(&dlock);
+  int len = snprintf(out, size,
+                     "dir_cache_bytes=%zu\n"
+                     "dir_cache_entries=%zu\n"
+                     "dir_cache_listings=%zu\n"
+                     "dir_cache_evictions=%zu\n",
+                     dcache_bytes, dcache_entries, dcache_listings,
+                     dcache_evictions);
+  pthread_rwlock_unlock(&dlock);
+  return len;
+}
+
+/* Appends one module's stats, which like snprintf() reports how much it
+   wanted to write; len is clamped so a full buffer just truncates. */
+static void append_stats(char *stats, size_t size, size_t *len,
+                         int (*x_stats)(char *out, size_t size))
+{
+  int added = x_stats(stats + *len, size - *len);
+  if (added > 0)
+    *len += added;
+  if (*len > size - 1)
+    *len = size - 1;
+}
+
+static int cfs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+  char stats[8192];
+  size_t len = 0;
+  if (strcmp(path, "/") || strcmp(name, STATS_XATTR))
+    return -ENODATA;
+  append_stats(stats, sizeof(stats), &len, bufpool_stats);
+  append_stats(stats, sizeof(stats), &len, dedup_stats);
+  append_stats(stats, sizeof(stats), &len, compress_stats);
+  append_stats(stats, sizeof(stats), &len, writeback_stats);
+  append_stats(stats, sizeof(stats), &len, readahead_stats);
+  append_stats(stats, sizeof(stats), &len, blockcache_stats);
+  append_stats(stats, sizeof(stats), &len, dir_cache_stats);
+  if (!size)
+    return len;
+  if (size < len)
+    return -ERANGE;
+  memcpy(value, stats, len);
+  return len;
+}
+
 static void *cfs_init(struct fuse_conn_info *conn)
 {
   signal(SIGPIPE, SIG_IGN);
+  writeback_init(writeback_failed);
+  readahead_init(prefetch_chunk);
   return NULL;
 }
 
+static void cfs_destroy(void *data)
+{
+  readahead_drain();
+  writeback_drain();
+}
+
 char *get_home_dir()
 {
   char *home;
@@ -434,6 +1513,21 @@ static struct options {
     char use_snet[OPTION_SIZE];
     char verify_ssl[OPTION_SIZE];
     char num_threads[OPTION_SIZE];
+    char compress_threads[OPTION_SIZE];
+    char queue_size[OPTION_SIZE];
+    char chunk_memory[OPTION_SIZE];
+    char dedup_entries[OPTION_SIZE];
+    char codec[OPTION_SIZE];
+    char writeback[OPTION_SIZE];
+    char writeback_bytes[OPTION_SIZE];
+    char spool_dir[OPTION_SIZE];
+    char stream_writes[OPTION_SIZE];
+    char chunk_reads[OPTION_SIZE];
+    char readahead[OPTION_SIZE];
+    char cache_dir[OPTION_SIZE];
+    char cache_bytes[OPTION_SIZE];
+    char dir_cache_max_bytes[OPTION_SIZE];
+    char dir_cache_max_entries[OPTION_SIZE];
     char chunk_size[OPTION_SIZE];
 } options = {
     .username = "",
@@ -445,6 +1539,21 @@ static struct options {
     .use_snet = "false",
     .verify_ssl = "true",
     .num_threads = "1",
+    .compress_threads = "1",
+    .queue_size = "32",
+    .chunk_memory = "67108864",
+    .dedup_entries = "65536",
+    .codec = "zlib",
+    .writeback = "false",
+    .writeback_bytes = "1073741824",
+    .spool_dir = "",
+    .stream_writes = "true",
+    .chunk_reads = "true",
+    .readahead = "8",
+    .cache_dir = "",
+    .cache_bytes = "1073741824",
+    .dir_cache_max_bytes = "268435456",
+    .dir_cache_max_entries = "1000000",
     .chunk_size = "131072",
 };
 
@@ -459,6 +1568,21 @@ int parse_option(void *data, const char *arg, int key, struct fuse_args *outargs
       sscanf(arg, " region = %[^\r\n ]", options.region) ||
       sscanf(arg, " use_snet = %[^\r\n ]", options.use_snet) ||
       sscanf(arg, " num_threads = %[^\r\n ]", options.num_threads) ||
+      sscanf(arg, " compress_threads = %[^\r\n ]", options.compress_threads) ||
+      sscanf(arg, " queue_size = %[^\r\n ]", options.queue_size) ||
+      sscanf(arg, " chunk_memory = %[^\r\n ]", options.chunk_memory) ||
+      sscanf(arg, " dedup_entries = %[^\r\n ]", options.dedup_entries) ||
+      sscanf(arg, " codec = %[^\r\n ]", options.codec) ||
+      sscanf(arg, " writeback = %[^\r\n ]", options.writeback) ||
+      sscanf(arg, " writeback_bytes = %[^\r\n ]", options.writeback_bytes) ||
+      sscanf(arg, " spool_dir = %[^\r\n ]", options.spool_dir) ||
+      sscanf(arg, " stream_writes = %[^\r\n ]", options.stream_writes) ||
+      sscanf(arg, " chunk_reads = %[^\r\n ]", options.chunk_reads) ||
+      sscanf(arg, " readahead = %[^\r\n ]", options.readahead) ||
+      sscanf(arg, " cache_dir = %[^\r\n ]", options.cache_dir) ||
+      sscanf(arg, " cache_bytes = %[^\r\n ]", options.cache_bytes) ||
+      sscanf(arg, " dir_cache_max_bytes = %[^\r\n ]", options.dir_cache_max_bytes) ||
+      sscanf(arg, " dir_cache_max_entries = %[^\r\n ]", options.dir_cache_max_entries) ||
       sscanf(arg, " chunk_size = %[^\r\n ]", options.chunk_size) ||
       sscanf(arg, " verify_ssl = %[^\r\n ]", options.verify_ssl))
     return 0;
@@ -485,8 +1609,48 @@ int main(int argc, char **argv)
   fuse_opt_parse(&args, &options, NULL, parse_option);
 
   cache_timeout = atoi(options.cache_timeout);
+  dir_cache_max_bytes = strtoull(options.dir_cache_max_bytes, NULL, 10);
+  dir_cache_max_entries = strtoull(options.dir_cache_max_entries, NULL, 10);
+  stream_writes = !strcasecmp(options.stream_writes, "true");
+  chunk_reads = !strcasecmp(options.chunk_reads, "true");
+  READAHEAD = atoi(options.readahead);
   NUM_THREADS = atoi(options.num_threads);
+  if (NUM_THREADS < 1)
+    NUM_THREADS = 1;
+  COMPRESS_THREADS = atoi(options.compress_threads);
+  if (COMPRESS_THREADS < 1)
+    COMPRESS_THREADS = 1;
+  QUEUE_SIZE = atoi(options.queue_size);
+  CHUNK_MEMORY = strtoull(options.chunk_memory, NULL, 10);
+  DEDUP_ENTRIES = atoi(options.dedup_entries);
+  WRITEBACK = !strcasecmp(options.writeback, "true");
+  WRITEBACK_BYTES = strtoull(options.writeback_bytes, NULL, 10);
+  if (*options.spool_dir)
+  {
+    /* resolved now, as FUSE changes to / when it daemonizes */
+    if ((mkdir(options.spool_dir, 0700) && errno != EEXIST) ||
+        !(SPOOL_DIR = realpath(options.spool_dir, NULL)))
+    {
+      fprintf(stderr, "Unable to create spool_dir %s.\n", options.spool_dir);
+      return 1;
+    }
+  }
+  if (*options.cache_dir)
+  {
+    if ((mkdir(options.cache_dir, 0700) && errno != EEXIST) ||
+        !(CACHE_DIR = realpath(options.cache_dir, NULL)))
+    {
+      fprintf(stderr, "Unable to create cache_dir %s.\n", options.cache_dir);
+      return 1;
+    }
+  }
+  CACHE_BYTES = strtoull(options.cache_bytes, NULL, 10);
   CHUNK = atoi(options.chunk_size);
+  if (!compress_init(options.codec))
+  {
+    fprintf(stderr, "Unknown or unsupported codec: %s\n", options.codec);
+    return 1;
+  }
 
 
   if (!*options.username || !*options.password)
@@ -508,6 +1672,8 @@ int main(int argc, char **argv)
   }
 
   cloudfs_init();
+  dedup_init();
+  blockcache_init();
 
   cloudfs_verify_ssl(!strcasecmp(options.verify_ssl, "true"));
 
@@ -545,10 +1711,17 @@ int main(int argc, char **argv)
     .chmod = cfs_chmod,
     .chown = cfs_chown,
     .rename = cfs_rename,
+    .getxattr = cfs_getxattr,
     .init = cfs_init,
+    .destroy = cfs_destroy,
   };
 
-  pthread_mutex_init(&dmut, NULL);
+  pthread_rwlock_init(&dlock, NULL);
+  pthread_mutex_init(&lmut, NULL);
+  pthread_cond_init(&lcond, NULL);
+  dcache_index = new_hash_table(64);
+  pthread_mutex_init(&omut, NULL);
+  pthread_cond_init(&ocond, NULL);
   return fuse_main(args.argc, args.argv, &cfs_oper, &options);
 }
 
@@ -0,0 +1,189 @@
+#include <string.h>
+#include "codec.h"
+#include "zpipe.h"
+#include "config.h"
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <pthread.h>
+#include <zstd.h>
+#endif
+
+/*
+ * Every backend compresses and decompresses whole buffers and returns 1
+ * on success, 0 on failure. *output_len holds the capacity of output on
+ * entry and the number of bytes produced on return.
+ */
+
+static size_t store_bound(size_t input_len) {
+  return input_len;
+}
+
+static int store_copy(const char *input, size_t input_len, char *output, size_t *output_len) {
+  if(input_len > *output_len)
+    return 0;
+  memcpy(output, input, input_len);
+  *output_len = input_len;
+  return 1;
+}
+
+static int store_compress(const char *input, size_t input_len, char *output, size_t *output_len, int level) {
+  (void)level;
+  return store_copy(input, input_len, output, output_len);
+}
+
+static int zlib_compress(const char *input, size_t input_len, char *output, size_t *output_len, int level) {
+  return def_buf((const unsigned char*)input, input_len, (unsigned char*)output, output_len, level) == Z_OK;
+}
+
+static int zlib_decompress(const char *input, size_t input_len, char *output, size_t *output_len) {
+  return inf_buf((const unsigned char*)input, input_len, (unsigned char*)output, output_len) == Z_OK;
+}
+
+#ifdef HAVE_LZ4
+static size_t lz4_bound(size_t input_len) {
+  return LZ4_compressBound(input_len);
+}
+
+/* level 1 is plain LZ4, anything higher selects LZ4HC at that level */
+static int lz4_compress(const char *input, size_t input_len, char *output, size_t *output_len, int level) {
+  int ret;
+  if(level <= 1)
+    ret = LZ4_compress_default(input, output, input_len, *output_len);
+  else
+    ret = LZ4_compress_HC(input, output, input_len, *output_len, level);
+  if(ret <= 0)
+    return 0;
+  *output_len = ret;
+  return 1;
+}
+
+static int lz4_decompress(const char *input, size_t input_len, char *output, size_t *output_len) {
+  int ret = LZ4_decompress_safe(input, output, input_len, *output_len);
+  if(ret < 0)
+    return 0;
+  *output_len = ret;
+  return 1;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/* Like the zlib streams in zpipe.c, each thread keeps its zstd contexts
+   rather than creating fresh ones for every chunk. */
+typedef struct zstd_contexts {
+  ZSTD_CCtx *cctx;
+  ZSTD_DCtx *dctx;
+} t_zstd_contexts;
+
+static pthread_key_t zstd_key;
+static pthread_once_t zstd_once = PTHREAD_ONCE_INIT;
+
+static void free_zstd_contexts(void *data) {
+  t_zstd_contexts *contexts = data;
+  ZSTD_freeCCtx(contexts->cctx);
+  ZSTD_freeDCtx(contexts->dctx);
+  free(contexts);
+}
+
+static void create_zstd_key() {
+  pthread_key_create(&zstd_key, free_zstd_contexts);
+}
+
+static t_zstd_contexts * thread_zstd_contexts() {
+  pthread_once(&zstd_once, create_zstd_key);
+  t_zstd_contexts *contexts = pthread_getspecific(zstd_key);
+  if(!contexts) {
+    contexts = calloc(1, sizeof(t_zstd_contexts));
+    if(contexts && pthread_setspecific(zstd_key, contexts)) {
+      free(contexts);
+      contexts = NULL;
+    }
+  }
+  return contexts;
+}
+
+static size_t zstd_bound(size_t input_len) {
+  return ZSTD_compressBound(input_len);
+}
+
+static int zstd_compress(const char *input, size_t input_len, char *output, size_t *output_len, int level) {
+  t_zstd_contexts *contexts = thread_zstd_contexts();
+  if(!contexts)
+    return 0;
+  if(!contexts->cctx && !(contexts->cctx = ZSTD_createCCtx()))
+    return 0;
+  size_t ret = ZSTD_compressCCtx(contexts->cctx, output, *output_len, input, input_len, level);
+  if(ZSTD_isError(ret))
+    return 0;
+  *output_len = ret;
+  return 1;
+}
+
+static int zstd_decompress(const char *input, size_t input_len, char *output, size_t *output_len) {
+  t_zstd_contexts *contexts = thread_zstd_contexts();
+  if(!contexts)
+    return 0;
+  if(!contexts->dctx && !(contexts->dctx = ZSTD_createDCtx()))
+    return 0;
+  size_t ret = ZSTD_decompressDCtx(contexts->dctx, output, *output_len, input, input_len);
+  if(ZSTD_isError(ret))
+    return 0;
+  *output_len = ret;
+  return 1;
+}
+#endif
+
+static const t_codec codecs[] = {
+  {"store", CODEC_STORE, store_bound, store_compress, store_copy},
+  {"zlib", CODEC_ZLIB, def_bound, zlib_compress, zlib_decompress},
+#ifdef HAVE_LZ4
+  {"lz4", CODEC_LZ4, lz4_bound, lz4_compress, lz4_decompress},
+#endif
+#ifdef HAVE_ZSTD
+  {"zstd", CODEC_ZSTD, zstd_bound, zstd_compress, zstd_decompress},
+#endif
+};
+
+#define NUM_CODECS (sizeof(codecs) / sizeof(codecs[0]))
+
+const t_codec * find_codec(int id) {
+  size_t i;
+  for(i = 0; i < NUM_CODECS; i++)
+    if(codecs[i].id == id)
+      return &codecs[i];
+  return NULL;
+}
+
+static void put_be32(unsigned char *out, size_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+static size_t get_be32(const unsigned char *in) {
+  return ((size_t)in[0] << 24) | ((size_t)in[1] << 16) | ((size_t)in[2] << 8) | in[3];
+}
+
+void put_frame_header(unsigned char *header, int codec, int level,
+                      size_t original_len, size_t payload_len) {
+  memcpy(header, FRAME_MAGIC, 2);
+  header[2] = codec;
+  header[3] = level;
+  put_be32(header + 4, original_len);
+  put_be32(header + 8, payload_len);
+}
+
+/* Returns 0 if header does not start with the frame magic. */
+int get_frame_header(const unsigned char *header, int *codec, int *level,
+                     size_t *original_len, size_t *payload_len) {
+  if(memcmp(header, FRAME_MAGIC, 2))
+    return 0;
+  *codec = header[2];
+  *level = (signed char)header[3];
+  *original_len = get_be32(header + 4);
+  *payload_len = get_be32(header + 8);
+  return 1;
+}
\ No newline at end of file
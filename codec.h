@@ -0,0 +1,34 @@
+#include <stdlib.h>
+
+#ifndef CODEC_GUARD
+#define CODEC_GUARD
+
+  #define CODEC_STORE 0
+  #define CODEC_ZLIB 1
+  #define CODEC_LZ4 2
+  #define CODEC_ZSTD 3
+
+  /* Framed chunks start with a 12 byte header: the magic "CF", the codec
+     id and level, then the original and payload lengths as big-endian
+     32-bit integers. A zlib stream can never start with the magic, which
+     is what tells framed data from legacy bare zlib chunks. */
+  #define FRAME_MAGIC "CF"
+  #define FRAME_HEADER_SIZE 12
+
+  typedef struct codec {
+    const char *name;
+    int id;
+    size_t (*bound)(size_t input_len);
+    int (*compress)(const char *input, size_t input_len,
+                    char *output, size_t *output_len, int level);
+    int (*decompress)(const char *input, size_t input_len,
+                      char *output, size_t *output_len);
+  } t_codec;
+
+  const t_codec * find_codec(int id);
+  void put_frame_header(unsigned char *header, int codec, int level,
+                        size_t original_len, size_t payload_len);
+  int get_frame_header(const unsigned char *header, int *codec, int *level,
+                       size_t *original_len, size_t *payload_len);
+
+#endif
\ No newline at end of file
@@ -1,45 +1,525 @@
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <strings.h>
 #include "compressapi.h"
+#include "config.h"
+#include "codec.h"
+#include "bufpool.h"
 
-int compression_level = 0;
+#define MAX_SETTINGS 10
+#define EWMA_WEIGHT 0.2
+#define PROBE_INTERVAL 8
+#define SWITCH_MARGIN 1.1
+#define DECISION_LOG 16
+#define SAMPLE_WINDOWS 4
+#define SAMPLE_WINDOW_SIZE 1024
+#define INCOMPRESSIBLE_ENTROPY 7.5
 
-int adaptive_inflate(FILE* input, FILE* output) {
-  return inf(input, output);
+/* One step of the controller: a codec and the level to run it at. The
+   settings of a mode are ordered from fastest to strongest, and the
+   first one always just stores the data. */
+typedef struct setting {
+  int codec;
+  int level;
+} t_setting;
+
+typedef struct mode {
+  const char *name;
+  const t_setting *settings;
+  int count;
+  int framed;
+} t_mode;
+
+static const t_setting zlib_settings[] = {
+  {CODEC_ZLIB, 0}, {CODEC_ZLIB, 1}, {CODEC_ZLIB, 2}, {CODEC_ZLIB, 3},
+  {CODEC_ZLIB, 4}, {CODEC_ZLIB, 5}, {CODEC_ZLIB, 6}, {CODEC_ZLIB, 7},
+  {CODEC_ZLIB, 8}, {CODEC_ZLIB, 9},
+};
+#ifdef HAVE_LZ4
+static const t_setting lz4_settings[] = {
+  {CODEC_STORE, 0}, {CODEC_LZ4, 1}, {CODEC_LZ4, 3}, {CODEC_LZ4, 6},
+  {CODEC_LZ4, 9}, {CODEC_LZ4, 12},
+};
+#endif
+#ifdef HAVE_ZSTD
+static const t_setting zstd_settings[] = {
+  {CODEC_STORE, 0}, {CODEC_ZSTD, 1}, {CODEC_ZSTD, 3}, {CODEC_ZSTD, 5},
+  {CODEC_ZSTD, 7}, {CODEC_ZSTD, 9}, {CODEC_ZSTD, 12}, {CODEC_ZSTD, 15},
+  {CODEC_ZSTD, 19},
+};
+#endif
+/* LZ4 for when compression is the bottleneck, zstd levels for when the
+   upload is; zlib only fills in for whichever library is missing. */
+static const t_setting auto_settings[] = {
+  {CODEC_STORE, 0},
+#ifdef HAVE_LZ4
+  {CODEC_LZ4, 1},
+#endif
+#ifdef HAVE_ZSTD
+  {CODEC_ZSTD, 1}, {CODEC_ZSTD, 3}, {CODEC_ZSTD, 6}, {CODEC_ZSTD, 9},
+  {CODEC_ZSTD, 15}, {CODEC_ZSTD, 19},
+#else
+  {CODEC_ZLIB, 1}, {CODEC_ZLIB, 6}, {CODEC_ZLIB, 9},
+#endif
+};
+
+#define MODE(name, settings, framed) \
+  {name, settings, sizeof(settings) / sizeof(settings[0]), framed}
+
+/* zlib mode writes bare zlib streams, exactly what older versions
+   uploaded; every other mode writes framed chunks. */
+static const t_mode modes[] = {
+  MODE("zlib", zlib_settings, 0),
+#ifdef HAVE_LZ4
+  MODE("lz4", lz4_settings, 1),
+#endif
+#ifdef HAVE_ZSTD
+  MODE("zstd", zstd_settings, 1),
+#endif
+  MODE("auto", auto_settings, 1),
+};
+
+typedef struct level_stats {
+  double compress_rate;
+  double ratio;
+  int samples;
+} t_level_stats;
+
+typedef struct decision {
+  time_t when;
+  int level;
+  double throughput;
+} t_decision;
+
+static pthread_mutex_t controller_lock = PTHREAD_MUTEX_INITIALIZER;
+static const t_mode *mode = &modes[0];
+static t_level_stats level_stats[MAX_SETTINGS];
+static double upload_rate = 0;
+static int upload_samples = 0;
+static int compressors = 1;
+static int uploaders = 1;
+static int compression_level = 1;
+static int chunks_since_probe = 0;
+static int probe_direction = 1;
+static t_decision decisions[DECISION_LOG];
+static int decision_count = 0;
+static size_t stored_chunks = 0;
+static size_t stored_bytes = 0;
+
+static double ewma(double average, double sample, int samples) {
+  return samples ? average + EWMA_WEIGHT * (sample - average) : sample;
+}
+
+static double now(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Original bytes per second the pipeline would deliver at level. The
+   compressors and the uploaders run concurrently, so whichever stage is
+   slower bounds the whole upload; a negative result means the level has
+   not been measured yet. */
+static double estimate(int level) {
+  t_level_stats *stats = &level_stats[level];
+  if(!stats->samples)
+    return -1;
+  double compress = stats->compress_rate * compressors;
+  if(!upload_samples || stats->ratio <= 0)
+    return compress;
+  double upload = upload_rate * uploaders / stats->ratio;
+  return compress < upload ? compress : upload;
+}
+
+/* Moves to the best measured level, but only when it beats the current
+   one by SWITCH_MARGIN so that noise does not make the level flap. */
+static void choose_level() {
+  int level, best = compression_level;
+  double best_rate = estimate(compression_level);
+  double threshold = best_rate * SWITCH_MARGIN;
+
+  for(level = 0; level < mode->count; level++) {
+    double rate = estimate(level);
+    if(rate > threshold && rate > best_rate) {
+      best = level;
+      best_rate = rate;
+    }
+  }
+  if(best == compression_level)
+    return;
+
+  compression_level = best;
+  t_decision *decision = &decisions[decision_count++ % DECISION_LOG];
+  decision->when = time(NULL);
+  decision->level = best;
+  decision->throughput = best_rate;
 }
 
-int adaptive_deflate(FILE* input, FILE* output) {
-  return def(input, output, compression_level);
+/* Every PROBE_INTERVAL chunks one chunk is compressed at a neighbouring
+   level, alternating up and down, to keep its measurements current. */
+static int next_level() {
+  pthread_mutex_lock(&controller_lock);
+  int level = compression_level;
+  if(++chunks_since_probe >= PROBE_INTERVAL) {
+    chunks_since_probe = 0;
+    int probe = level + probe_direction;
+    if(probe < 0 || probe >= mode->count)
+      probe = level - probe_direction;
+    probe_direction = -probe_direction;
+    level = probe;
+  }
+  pthread_mutex_unlock(&controller_lock);
+  return level;
 }
 
-void reset_level() {
-  compression_level = 0;
+static int compress_with(int setting, const char* input, size_t input_len, char* output, size_t* output_len) {
+  const t_setting *current = &mode->settings[setting];
+  const t_codec *codec = find_codec(current->codec);
+
+  if(!mode->framed)
+    return codec->compress(input, input_len, output, output_len, current->level);
+  if(*output_len < FRAME_HEADER_SIZE)
+    return 0;
+  size_t payload_len = *output_len - FRAME_HEADER_SIZE;
+  if(!codec->compress(input, input_len, output + FRAME_HEADER_SIZE, &payload_len, current->level))
+    return 0;
+  put_frame_header((unsigned char*)output, current->codec, current->level, input_len, payload_len);
+  *output_len = FRAME_HEADER_SIZE + payload_len;
+  return 1;
 }
 
-void update_level(int diff) {
-  int size = fifo_size();
+static void record_compress(int level, size_t input_len, size_t output_len, double seconds) {
+  if(input_len == 0 || seconds <= 0)
+    return;
+  pthread_mutex_lock(&controller_lock);
+  t_level_stats *stats = &level_stats[level];
+  stats->compress_rate = ewma(stats->compress_rate, input_len / seconds, stats->samples);
+  stats->ratio = ewma(stats->ratio, (double)output_len / input_len, stats->samples);
+  stats->samples++;
+  choose_level();
+  pthread_mutex_unlock(&controller_lock);
+}
+
+/* Shannon entropy, in bits per byte, of a few windows spread across the
+   chunk. Already-compressed data (JPEG, video, gzip) sits close to 8,
+   anything deflate can shrink noticeably sits well below. */
+static int looks_incompressible(const char* input, size_t input_len) {
+  size_t counts[256] = {0};
+  size_t window = SAMPLE_WINDOW_SIZE, sampled = 0;
+  int i, w;
+
+  if(input_len < SAMPLE_WINDOWS * SAMPLE_WINDOW_SIZE)
+    return 0;
+  for(w = 0; w < SAMPLE_WINDOWS; w++) {
+    const unsigned char *start = (const unsigned char*)input +
+        (input_len - window) / (SAMPLE_WINDOWS - 1) * w;
+    size_t j;
+    for(j = 0; j < window; j++)
+      counts[start[j]]++;
+    sampled += window;
+  }
+
+  double entropy = 0;
+  for(i = 0; i < 256; i++) {
+    if(counts[i]) {
+      double p = (double)counts[i] / sampled;
+      entropy -= p * log2(p);
+    }
+  }
+  return entropy > INCOMPRESSIBLE_ENTROPY;
+}
 
-  if (size < 10) {
-    if (diff <= 0) {
-      compression_level = compression_level / 2;
+/* Selects the codec mode by name: zlib, lz4, zstd or auto. Returns 0 if
+   the mode is unknown or was not compiled in. */
+int compress_init(const char *name) {
+  size_t i;
+  for(i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    if(!strcasecmp(modes[i].name, name)) {
+      mode = &modes[i];
+      compression_level = 1;
+      return 1;
     }
-  } else if (size < 20) {
-    if (diff > 0) {
-      compression_level++;
-    } else if (diff < 0) {
-      compression_level--;
+  }
+  return 0;
+}
+
+#define INFLATE_START 0
+#define INFLATE_ZLIB 1
+#define INFLATE_HEADER 2
+#define INFLATE_PAYLOAD 3
+
+/* Incremental decoder for a downloaded object, which is the series of
+   its chunks. Chunks uploaded in zlib mode are bare zlib streams, the
+   others are frames naming the codec that produced them. A file written
+   under one mode and partly re-uploaded under another holds both, so
+   the first two bytes of every chunk tell which it is. */
+struct inflater {
+  int state;
+  inflater_sink sink;
+  void *ctx;
+  z_stream strm;
+  unsigned char *out;
+  unsigned char header[FRAME_HEADER_SIZE];
+  size_t header_len;
+  const t_codec *codec;
+  char *payload;
+  size_t payload_len;
+  size_t payload_got;
+  size_t original_len;
+};
+
+t_inflater * new_inflater(inflater_sink sink, void *ctx) {
+  t_inflater *inflater = (t_inflater*) calloc(1, sizeof(t_inflater));
+  if(inflater) {
+    inflater->state = INFLATE_START;
+    inflater->sink = sink;
+    inflater->ctx = ctx;
+  }
+  return inflater;
+}
+
+/* Copies up to want - *have bytes of input into dest, advancing input. */
+static int take(void *dest, size_t *have, size_t want, const char **data, size_t *len) {
+  size_t n = want - *have < *len ? want - *have : *len;
+  memcpy((char*)dest + *have, *data, n);
+  *have += n;
+  *data += n;
+  *len -= n;
+  return *have == want;
+}
+
+/* Inflates input up to the end of the current zlib stream, advancing
+   data past what it used; whatever follows the stream is the next
+   chunk. */
+static int push_zlib(t_inflater *inflater, const char **data, size_t *len) {
+  const unsigned char *in = (const unsigned char*) *data;
+  size_t out_len;
+  int ret;
+
+  do {
+    out_len = CHUNK;
+    ret = inf_push(&inflater->strm, &in, len, inflater->out, &out_len);
+    *data = (const char*) in;
+    if(ret != Z_OK && ret != Z_STREAM_END)
+      return ret;
+    if(inflater->sink((char*)inflater->out, out_len, inflater->ctx) != out_len)
+      return Z_ERRNO;
+    if(ret == Z_STREAM_END) {
+      inflater->header_len = 0;
+      inflater->state = INFLATE_START;
+      return Z_OK;
     }
-  } else if (size < 30) {
-    if (diff > 0) {
-      compression_level += 2;
-    } else if (diff < 0) {
-      compression_level--;
+  } while(*len > 0 || out_len == (size_t)CHUNK);
+  return Z_OK;
+}
+
+static int start_zlib(t_inflater *inflater) {
+  const char *header = (const char*) inflater->header;
+  size_t header_len = 2;
+  int ret;
+
+  if(inflater->out)
+    ret = inf_reset(&inflater->strm);
+  else if(!(inflater->out = get_buffer(CHUNK)))
+    return Z_MEM_ERROR;
+  else
+    ret = inf_init(&inflater->strm);
+  if(ret != Z_OK)
+    return ret;
+  inflater->state = INFLATE_ZLIB;
+  return push_zlib(inflater, &header, &header_len);
+}
+
+static int start_frame(t_inflater *inflater) {
+  int codec_id, level;
+  if(!get_frame_header(inflater->header, &codec_id, &level,
+                       &inflater->original_len, &inflater->payload_len))
+    return Z_DATA_ERROR;
+  if(!(inflater->codec = find_codec(codec_id)))
+    return Z_DATA_ERROR;
+  /* no chunk decodes to more than CHUNK bytes, so larger lengths mean a
+     corrupt header and must not size the buffers */
+  if(inflater->original_len > (size_t)CHUNK ||
+     inflater->payload_len > inflater->codec->bound(CHUNK))
+    return Z_DATA_ERROR;
+  if(!(inflater->payload = get_buffer(inflater->payload_len)))
+    return Z_MEM_ERROR;
+  inflater->payload_got = 0;
+  inflater->state = INFLATE_PAYLOAD;
+  return Z_OK;
+}
+
+static int finish_frame(t_inflater *inflater) {
+  int ret = Z_OK;
+  size_t decoded_len = inflater->original_len;
+  char *decoded = get_buffer(decoded_len);
+
+  if(!decoded)
+    ret = Z_MEM_ERROR;
+  else if(!inflater->codec->decompress(inflater->payload, inflater->payload_len, decoded, &decoded_len) ||
+          decoded_len != inflater->original_len)
+    ret = Z_DATA_ERROR;
+  else if(inflater->sink(decoded, decoded_len, inflater->ctx) != decoded_len)
+    ret = Z_ERRNO;
+  put_buffer(decoded);
+  put_buffer(inflater->payload);
+  inflater->payload = NULL;
+  inflater->header_len = 0;
+  inflater->state = INFLATE_START;
+  return ret;
+}
+
+/* Feeds the next len bytes of the object through the decoder, passing
+   decoded data to the sink as it becomes available. Returns Z_OK, or a
+   zlib error code after which the inflater must only be finished. */
+int push_inflater(t_inflater *inflater, const char *data, size_t len) {
+  int ret = Z_OK;
+
+  while(len > 0 && ret == Z_OK) {
+    switch(inflater->state) {
+      case INFLATE_START:
+        if(!take(inflater->header, &inflater->header_len, 2, &data, &len))
+          break;
+        if(!memcmp(inflater->header, FRAME_MAGIC, 2))
+          inflater->state = INFLATE_HEADER;
+        else
+          ret = start_zlib(inflater);
+        break;
+      case INFLATE_ZLIB:
+        ret = push_zlib(inflater, &data, &len);
+        break;
+      case INFLATE_HEADER:
+        if(take(inflater->header, &inflater->header_len, FRAME_HEADER_SIZE, &data, &len))
+          ret = start_frame(inflater);
+        break;
+      case INFLATE_PAYLOAD:
+        if(take(inflater->payload, &inflater->payload_got, inflater->payload_len, &data, &len))
+          ret = finish_frame(inflater);
+        break;
     }
-  } else if (diff > 0) {
-    compression_level += 2;
   }
+  /* an empty payload completes its frame without consuming any input */
+  if(ret == Z_OK && inflater->state == INFLATE_PAYLOAD && inflater->payload_len == 0)
+    ret = finish_frame(inflater);
+  return ret;
+}
+
+static void release_inflater(t_inflater *inflater) {
+  if(inflater->out) {
+    inf_end(&inflater->strm);
+    put_buffer(inflater->out);
+    inflater->out = NULL;
+  }
+  put_buffer(inflater->payload);
+  inflater->payload = NULL;
+}
+
+/* Starts the inflater over on a new copy of the object, as when a
+   download is retried; the sink is kept. */
+void reset_inflater(t_inflater *inflater) {
+  release_inflater(inflater);
+  inflater->state = INFLATE_START;
+  inflater->header_len = 0;
+}
+
+/* Frees the inflater. Returns Z_OK if the object ended cleanly, or
+   Z_DATA_ERROR if it was cut off in the middle of a stream or frame. */
+int finish_inflater(t_inflater *inflater) {
+  if(!inflater)
+    return Z_MEM_ERROR;
+  int complete = inflater->state == INFLATE_START && inflater->header_len == 0;
+  release_inflater(inflater);
+  free(inflater);
+  return complete ? Z_OK : Z_DATA_ERROR;
+}
+
+/* Chunks that sample as incompressible skip straight to the first
+   setting of the mode, which stores them: zlib level 0 in zlib mode, so
+   the result is still a zlib stream, or a stored frame otherwise. */
+int adaptive_deflate(const char* input, size_t input_len, char* output, size_t* output_len) {
+  if(looks_incompressible(input, input_len)) {
+    pthread_mutex_lock(&controller_lock);
+    stored_chunks++;
+    stored_bytes += input_len;
+    pthread_mutex_unlock(&controller_lock);
+    return compress_with(0, input, input_len, output, output_len) ? Z_OK : Z_BUF_ERROR;
+  }
+
+  int level = next_level();
+  double start = now(CLOCK_THREAD_CPUTIME_ID);
+  if(!compress_with(level, input, input_len, output, output_len))
+    return Z_BUF_ERROR;
+  record_compress(level, input_len, *output_len, now(CLOCK_THREAD_CPUTIME_ID) - start);
+  return Z_OK;
+}
+
+/* Room for the output of any setting of the current mode. */
+size_t adaptive_deflate_bound(size_t input_len) {
+  size_t bound = 0;
+  int i;
+  for(i = 0; i < mode->count; i++) {
+    size_t codec_bound = find_codec(mode->settings[i].codec)->bound(input_len);
+    if(codec_bound > bound)
+      bound = codec_bound;
+  }
+  return mode->framed ? FRAME_HEADER_SIZE + bound : bound;
+}
 
-  if(compression_level > 9) {
-    compression_level = 9;
-  } else if (compression_level < 0) {
-    compression_level = 0;
+/* Called at the start of each upload with the number of threads on
+   either side of the queue. Measurements are kept across uploads. */
+void reset_level(int compress_threads, int upload_threads) {
+  pthread_mutex_lock(&controller_lock);
+  compressors = compress_threads > 0 ? compress_threads : 1;
+  uploaders = upload_threads > 0 ? upload_threads : 1;
+  chunks_since_probe = 0;
+  pthread_mutex_unlock(&controller_lock);
+}
+
+/* Called by uploaders with the compressed bytes of one chunk and the
+   wall-clock time its PUT took. */
+void record_upload(size_t bytes, double seconds) {
+  if(seconds <= 0)
+    return;
+  pthread_mutex_lock(&controller_lock);
+  upload_rate = ewma(upload_rate, bytes / seconds, upload_samples);
+  upload_samples++;
+  pthread_mutex_unlock(&controller_lock);
+}
+
+static const char * setting_name(int setting) {
+  return find_codec(mode->settings[setting].codec)->name;
+}
+
+int compress_stats(char *out, size_t size) {
+  int level, i;
+  size_t len = 0;
+  pthread_mutex_lock(&controller_lock);
+  len += snprintf(out + len, size - len,
+                  "compress_mode=%s\n"
+                  "compress_level=%s-%d\n"
+                  "compress_upload_rate=%.0f\n"
+                  "compress_stored_chunks=%zu\n"
+                  "compress_stored_bytes=%zu\n",
+                  mode->name, setting_name(compression_level),
+                  mode->settings[compression_level].level,
+                  upload_rate, stored_chunks, stored_bytes);
+  for(level = 0; level < mode->count && len < size; level++) {
+    t_level_stats *stats = &level_stats[level];
+    if(stats->samples)
+      len += snprintf(out + len, size - len,
+                      "compress_level_%s-%d=rate %.0f ratio %.3f samples %d estimate %.0f\n",
+                      setting_name(level), mode->settings[level].level, stats->compress_rate, stats->ratio, stats->samples,
+                      estimate(level));
+  }
+  i = decision_count > DECISION_LOG ? decision_count - DECISION_LOG : 0;
+  for(; i < decision_count && len < size; i++) {
+    t_decision *decision = &decisions[i % DECISION_LOG];
+    len += snprintf(out + len, size - len,
+                    "compress_decision=%ld level %s-%d estimate %.0f\n",
+                    (long)decision->when, setting_name(decision->level),
+                    mode->settings[decision->level].level, decision->throughput);
   }
+  pthread_mutex_unlock(&controller_lock);
+  return len < size ? len : size - 1;
 }
\ No newline at end of file
@@ -5,9 +5,19 @@
 #ifndef COMPRESS_GUARD
 #define COMPRESS_GUARD
 
-  int adaptive_inflate(FILE* input, FILE* output);
-  int adaptive_deflate(FILE* input, FILE* output);
-  void reset_level();
-  void update_level(int diff);
+  /* Receives decoded data from an inflater; returns the bytes consumed. */
+  typedef size_t (*inflater_sink)(const char *data, size_t len, void *ctx);
+  typedef struct inflater t_inflater;
+
+  int compress_init(const char *name);
+  t_inflater * new_inflater(inflater_sink sink, void *ctx);
+  int push_inflater(t_inflater *inflater, const char *data, size_t len);
+  void reset_inflater(t_inflater *inflater);
+  int finish_inflater(t_inflater *inflater);
+  int adaptive_deflate(const char* input, size_t input_len, char* output, size_t* output_len);
+  size_t adaptive_deflate_bound(size_t input_len);
+  void reset_level(int compress_threads, int upload_threads);
+  void record_upload(size_t bytes, double seconds);
+  int compress_stats(char *out, size_t size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "dedup.h"
+#include "config.h"
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#endif
+
+typedef struct dedup_entry {
+  uint64_t path_hash;
+  uint64_t generation;
+  int index;
+  int used;
+  unsigned char digest[DEDUP_DIGEST_SIZE];
+} t_dedup_entry;
+
+/* Chunk entries are only valid while their generation matches the one
+   of the path's record, so a whole path is forgotten by giving it a new
+   generation instead of searching the table for its chunks. A record
+   also knows the highest index stored under it, which bounds the slots
+   to clear when only the tail of an object goes away. */
+typedef struct dedup_path {
+  uint64_t path_hash;
+  uint64_t generation;
+  int max_index;
+} t_dedup_path;
+
+static t_dedup_entry *table = NULL;
+static t_dedup_path *paths = NULL;
+static uint64_t next_generation = 0;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t dedup_lookups = 0;
+static size_t dedup_hits = 0;
+
+static uint64_t hash_path(const char *path) {
+  uint64_t hash = 14695981039346656037ULL;
+  while(*path) {
+    hash ^= (unsigned char)*path++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static t_dedup_entry * slot_for(uint64_t path_hash, int index) {
+  uint64_t hash = path_hash ^ ((uint64_t)index * 0x9e3779b97f4a7c15ULL);
+  return &table[hash % DEDUP_ENTRIES];
+}
+
+/* Returns the record of path_hash, or NULL if it has none; a record
+   lost to a colliding path only costs that path its entries. */
+static t_dedup_path * find_path(uint64_t path_hash) {
+  t_dedup_path *record = &paths[path_hash % DEDUP_ENTRIES];
+  return record->generation && record->path_hash == path_hash ? record : NULL;
+}
+
+static void new_generation(t_dedup_path *record, uint64_t path_hash) {
+  record->path_hash = path_hash;
+  record->generation = ++next_generation;
+  record->max_index = -1;
+}
+
+void dedup_init() {
+#ifdef HAVE_OPENSSL
+  if(DEDUP_ENTRIES > 0) {
+    table = (t_dedup_entry*) calloc(DEDUP_ENTRIES, sizeof(t_dedup_entry));
+    paths = (t_dedup_path*) calloc(DEDUP_ENTRIES, sizeof(t_dedup_path));
+  }
+#endif
+}
+
+/* Returns 0 when deduplication is disabled (no table, or built without
+   OpenSSL), in which case digest is left untouched. */
+int chunk_digest(const char *data, size_t size, unsigned char *digest) {
+#ifdef HAVE_OPENSSL
+  if(table != NULL) {
+    SHA256((const unsigned char*)data, size, digest);
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+int dedup_lookup(const char *path, int index, const unsigned char *digest) {
+  int found;
+  if(table == NULL)
+    return 0;
+  uint64_t path_hash = hash_path(path);
+  pthread_mutex_lock(&table_lock);
+  t_dedup_path *record = find_path(path_hash);
+  t_dedup_entry *entry = slot_for(path_hash, index);
+  found = record && entry->used && entry->generation == record->generation &&
+          entry->path_hash == path_hash && entry->index == index &&
+          !memcmp(entry->digest, digest, DEDUP_DIGEST_SIZE);
+  dedup_lookups++;
+  if(found)
+    dedup_hits++;
+  pthread_mutex_unlock(&table_lock);
+  return found;
+}
+
+void dedup_store(const char *path, int index, const unsigned char *digest) {
+  if(table == NULL)
+    return;
+  uint64_t path_hash = hash_path(path);
+  pthread_mutex_lock(&table_lock);
+  t_dedup_path *record = find_path(path_hash);
+  if(!record) {
+    record = &paths[path_hash % DEDUP_ENTRIES];
+    new_generation(record, path_hash);
+  }
+  if(index > record->max_index)
+    record->max_index = index;
+  t_dedup_entry *entry = slot_for(path_hash, index);
+  entry->path_hash = path_hash;
+  entry->generation = record->generation;
+  entry->index = index;
+  entry->used = 1;
+  memcpy(entry->digest, digest, DEDUP_DIGEST_SIZE);
+  pthread_mutex_unlock(&table_lock);
+}
+
+/* Drops what is known about chunks first_index and up of path; called
+   when an upload shrinks the object, or with 0 whenever the object is
+   replaced or removed by anything other than a chunked upload. Costs
+   nothing for the whole object and one slot per dropped chunk
+   otherwise, however large the table. */
+void dedup_forget(const char *path, int first_index) {
+  int i;
+  if(table == NULL)
+    return;
+  uint64_t path_hash = hash_path(path);
+  pthread_mutex_lock(&table_lock);
+  t_dedup_path *record = find_path(path_hash);
+  if(record && first_index <= 0) {
+    new_generation(record, path_hash);
+  } else if(record) {
+    for(i = first_index; i <= record->max_index; i++) {
+      t_dedup_entry *entry = slot_for(path_hash, i);
+      if(entry->path_hash == path_hash && entry->index == i)
+        entry->used = 0;
+    }
+    if(record->max_index >= first_index)
+      record->max_index = first_index - 1;
+  }
+  pthread_mutex_unlock(&table_lock);
+}
+
+int dedup_stats(char *out, size_t size) {
+  pthread_mutex_lock(&table_lock);
+  int len = snprintf(out, size,
+                     "dedup_lookups=%zu\n"
+                     "dedup_hits=%zu\n"
+                     "dedup_hit_rate=%.3f\n",
+                     dedup_lookups, dedup_hits,
+                     dedup_lookups ? (double)dedup_hits / dedup_lookups : 0.0);
+  pthread_mutex_unlock(&table_lock);
+  return len;
+}
\ No newline at end of file
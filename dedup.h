@@ -0,0 +1,22 @@
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifndef DEDUP_GUARD
+#define DEDUP_GUARD
+
+  #define DEDUP_DIGEST_SIZE 32
+
+  int DEDUP_ENTRIES;
+
+  /* Remembers the digest of every chunk successfully stored at
+     (path, index), so that an identical chunk does not have to be sent
+     again. The index is a fixed-size table of DEDUP_ENTRIES slots; a
+     collision simply evicts the older entry. */
+  void dedup_init();
+  int chunk_digest(const char *data, size_t size, unsigned char *digest);
+  int dedup_lookup(const char *path, int index, const unsigned char *digest);
+  void dedup_store(const char *path, int index, const unsigned char *digest);
+  void dedup_forget(const char *path, int first_index);
+  int dedup_stats(char *out, size_t size);
+
+#endif
\ No newline at end of file
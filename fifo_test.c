@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "fifo_ts.h"
+
+/*
+ * Stress test for the fifo ring: producers push numbered items while
+ * consumers pop them until the ring is closed. Afterwards every item
+ * must have been popped exactly once, and no consumer may have seen two
+ * items of the same producer out of order. Small capacities keep both
+ * sides sleeping on a full or empty ring most of the time.
+ *
+ *   fifo_test [producers consumers items capacity]
+ */
+
+typedef struct stress {
+  t_fifo *fifo;
+  int producers;
+  int items;
+  unsigned char *seen;
+  int failures;
+} t_stress;
+
+typedef struct worker {
+  t_stress *stress;
+  int id;
+  pthread_t thread;
+} t_worker;
+
+static void *produce(void *arg) {
+  t_worker *worker = arg;
+  t_stress *stress = worker->stress;
+  int i;
+  for(i = 0; i < stress->items; i++)
+    push_fifo(stress->fifo, worker->id * stress->items + i, NULL);
+  return NULL;
+}
+
+static void *consume(void *arg) {
+  t_worker *worker = arg;
+  t_stress *stress = worker->stress;
+  int *last = malloc(stress->producers * sizeof(int));
+  int index, i;
+  void *data;
+  for(i = 0; i < stress->producers; i++)
+    last[i] = -1;
+  while(pop_fifo(stress->fifo, &index, &data)) {
+    int producer = index / stress->items, seq = index % stress->items;
+    if(seq <= last[producer] ||
+       __atomic_fetch_add(&stress->seen[index], 1, __ATOMIC_RELAXED))
+      __atomic_add_fetch(&stress->failures, 1, __ATOMIC_RELAXED);
+    last[producer] = seq;
+  }
+  free(last);
+  return NULL;
+}
+
+static int run(int producers, int consumers, int items, int capacity) {
+  t_stress stress = {new_fifo(capacity), producers, items, NULL, 0};
+  t_worker *workers = calloc(producers + consumers, sizeof(t_worker));
+  size_t total = (size_t)producers * items, missing = 0, i;
+  struct timespec start, end;
+  int w;
+
+  stress.seen = calloc(total, 1);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for(w = 0; w < producers + consumers; w++) {
+    workers[w].stress = &stress;
+    workers[w].id = w;
+    pthread_create(&workers[w].thread, NULL, w < producers ? produce : consume, &workers[w]);
+  }
+  for(w = 0; w < producers; w++)
+    pthread_join(workers[w].thread, NULL);
+  close_fifo(stress.fifo);
+  for(; w < producers + consumers; w++)
+    pthread_join(workers[w].thread, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for(i = 0; i < total; i++)
+    if(!stress.seen[i])
+      missing++;
+  double seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%2d producers %2d consumers capacity %4d: %zu items in %.3fs (%.0f/s)",
+         producers, consumers, capacity, total, seconds, seconds > 0 ? total / seconds : 0);
+  int ok = !missing && !stress.failures && fifo_size(stress.fifo) == 0;
+  if(ok)
+    printf(" ok\n");
+  else
+    printf(" FAILED: %zu missing, %d duplicated or out of order\n", missing, stress.failures);
+
+  free(stress.seen);
+  free(workers);
+  free_fifo(stress.fifo);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  static const int cases[][3] = {
+    {1, 1, 1}, {1, 1, 2}, {1, 4, 2}, {4, 1, 2}, {4, 4, 4},
+    {8, 8, 16}, {16, 2, 64}, {2, 16, 64}, {8, 8, 1024},
+  };
+  int ok = 1;
+  size_t i;
+
+  if(argc == 5)
+    return !run(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+  if(argc != 1) {
+    fprintf(stderr, "usage: %s [producers consumers items capacity]\n", argv[0]);
+    return 2;
+  }
+  for(i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    ok &= run(cases[i][0], cases[i][1], 50000, cases[i][2]);
+  return !ok;
+}
@@ -1,56 +1,139 @@
+#include <stdint.h>
 #include "fifo_ts.h"
 
-t_fifo_elem *fifo = NULL;
-t_fifo_elem *last = NULL;
-pthread_mutex_t lock;
+t_fifo * new_fifo(int capacity) {
+  t_fifo *fifo = (t_fifo*) calloc(1, sizeof(t_fifo));
+  size_t i;
+  /* a single slot cannot tell "full" from "empty" by sequence alone */
+  fifo->capacity = capacity > 1 ? capacity : 2;
+  fifo->slots = (t_fifo_slot*) calloc(fifo->capacity, sizeof(t_fifo_slot));
+  for(i = 0; i < fifo->capacity; i++)
+    fifo->slots[i].seq = i;
+  pthread_mutex_init(&fifo->lock, NULL);
+  pthread_cond_init(&fifo->changed, NULL);
+  return fifo;
+}
 
-int init_fifo() {
-  return (pthread_mutex_init(&lock, NULL) == 0);
+void free_fifo(t_fifo *fifo) {
+  pthread_cond_destroy(&fifo->changed);
+  pthread_mutex_destroy(&fifo->lock);
+  free(fifo->slots);
+  free(fifo);
 }
 
-t_fifo_elem * pop_fifo() {
-  t_fifo_elem *ret;
-  pthread_mutex_lock(&lock);
-  if(fifo == NULL) {
-    ret = NULL;
-  } else {
-    t_fifo_elem *elem = fifo;
-    fifo = elem->next;
+static int try_push(t_fifo *fifo, int index, void* data) {
+  size_t pos = __atomic_load_n(&fifo->tail, __ATOMIC_RELAXED);
+  t_fifo_slot *slot;
+  for(;;) {
+    slot = &fifo->slots[pos % fifo->capacity];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+    if(dif == 0) {
+      if(__atomic_compare_exchange_n(&fifo->tail, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if(dif < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&fifo->tail, __ATOMIC_RELAXED);
+    }
+  }
+  slot->index = index;
+  slot->data = data;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
 
-    if(elem == last)
-      last = NULL;
+static int try_pop(t_fifo *fifo, int *index, void** data) {
+  size_t pos = __atomic_load_n(&fifo->head, __ATOMIC_RELAXED);
+  t_fifo_slot *slot;
+  for(;;) {
+    slot = &fifo->slots[pos % fifo->capacity];
+    size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+    if(dif == 0) {
+      if(__atomic_compare_exchange_n(&fifo->head, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if(dif < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&fifo->head, __ATOMIC_RELAXED);
+    }
+  }
+  *index = slot->index;
+  *data = slot->data;
+  __atomic_store_n(&slot->seq, pos + fifo->capacity, __ATOMIC_RELEASE);
+  return 1;
+}
 
-    ret = elem;
+/* Wakes sleepers after a successful push or pop. The fence pairs with the
+   one in start_wait() so that either we see the waiter or the waiter's
+   retry sees our slot. */
+static void wake_waiters(t_fifo *fifo) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&fifo->waiters, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&fifo->lock);
+    pthread_cond_broadcast(&fifo->changed);
+    pthread_mutex_unlock(&fifo->lock);
   }
-  pthread_mutex_unlock(&lock);
-  return ret;
-}
-
-void push_fifo(int index, FILE* data) {
-  t_fifo_elem *elem = (t_fifo_elem*) malloc(sizeof(t_fifo_elem));
-  elem->index = index;
-  elem->data = data;
-  elem->next = NULL;
-
-  pthread_mutex_lock(&lock);
-  if(fifo == NULL) {
-    fifo = elem;
-    last = elem;
-  } else {
-    last->next = elem;
-    last = elem;
+}
+
+static void start_wait(t_fifo *fifo) {
+  pthread_mutex_lock(&fifo->lock);
+  __atomic_add_fetch(&fifo->waiters, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void end_wait(t_fifo *fifo) {
+  __atomic_sub_fetch(&fifo->waiters, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&fifo->lock);
+}
+
+/* Blocks until an element is available. Returns 0 once the fifo has been
+   closed and drained, 1 otherwise. */
+int pop_fifo(t_fifo *fifo, int *index, void** data) {
+  int got = try_pop(fifo, index, data);
+  if(!got) {
+    start_wait(fifo);
+    while(!(got = try_pop(fifo, index, data))) {
+      if(__atomic_load_n(&fifo->closed, __ATOMIC_ACQUIRE)) {
+        got = try_pop(fifo, index, data);
+        break;
+      }
+      pthread_cond_wait(&fifo->changed, &fifo->lock);
+    }
+    end_wait(fifo);
   }
-  pthread_mutex_unlock(&lock);
+  if(got)
+    wake_waiters(fifo);
+  return got;
 }
 
-int fifo_size() {
-  int ret = 0;
-  pthread_mutex_lock(&lock);
-  t_fifo_elem * elem = fifo;
-  while(elem != NULL) {
-    ret++;
-    elem = elem->next;
+/* Blocks while the fifo holds capacity elements. */
+void push_fifo(t_fifo *fifo, int index, void* data) {
+  if(!try_push(fifo, index, data)) {
+    start_wait(fifo);
+    while(!try_push(fifo, index, data))
+      pthread_cond_wait(&fifo->changed, &fifo->lock);
+    end_wait(fifo);
   }
-  pthread_mutex_unlock(&lock);
-  return ret;
+  wake_waiters(fifo);
+}
+
+/* Signals end of stream: consumers drain what is left, then pop_fifo()
+   returns 0. */
+void close_fifo(t_fifo *fifo) {
+  __atomic_store_n(&fifo->closed, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&fifo->lock);
+  pthread_cond_broadcast(&fifo->changed);
+  pthread_mutex_unlock(&fifo->lock);
+}
+
+int fifo_size(t_fifo *fifo) {
+  size_t head = __atomic_load_n(&fifo->head, __ATOMIC_ACQUIRE);
+  size_t tail = __atomic_load_n(&fifo->tail, __ATOMIC_ACQUIRE);
+  if(tail <= head)
+    return 0;
+  return tail - head > fifo->capacity ? fifo->capacity : tail - head;
 }
\ No newline at end of file
@@ -5,15 +5,37 @@
 #ifndef FIFO_DEF_GUARD
 #define FIFO_DEF_GUARD
 
-  typedef struct fifo_elem {
-  	int index;
-  	FILE* data;
-  	struct fifo_elem* next;
-  } t_fifo_elem;
+  #define FIFO_CACHE_LINE 64
 
-  int init_fifo();
-  t_fifo_elem * pop_fifo();
-  void push_fifo(int index, FILE* data);
-  int fifo_size();
+  typedef struct fifo_slot {
+    size_t seq;
+    int index;
+    void* data;
+  } t_fifo_slot;
+
+  /* Bounded multi-producer/multi-consumer ring. Producers and consumers
+     claim slots by advancing tail/head atomically and hand them over
+     through the per-slot sequence number; the mutex and condition
+     variable are only touched when a caller has to sleep on a full or
+     empty ring. */
+  typedef struct fifo {
+    size_t head;
+    char head_pad[FIFO_CACHE_LINE - sizeof(size_t)];
+    size_t tail;
+    char tail_pad[FIFO_CACHE_LINE - sizeof(size_t)];
+    t_fifo_slot *slots;
+    size_t capacity;
+    int closed;
+    int waiters;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+  } t_fifo;
+
+  t_fifo * new_fifo(int capacity);
+  void free_fifo(t_fifo *fifo);
+  void push_fifo(t_fifo *fifo, int index, void* data);
+  int pop_fifo(t_fifo *fifo, int *index, void** data);
+  void close_fifo(t_fifo *fifo);
+  int fifo_size(t_fifo *fifo);
 
 #endif
\ No newline at end of file
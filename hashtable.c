@@ -0,0 +1,95 @@
+#include <stdint.h>
+#include <string.h>
+#include "hashtable.h"
+
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 14695981039346656037ULL;
+  while(*key) {
+    hash ^= (unsigned char)*key++;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static t_hash_node ** find_node(t_hash_table *table, const char *key) {
+  t_hash_node **link = &table->buckets[hash_key(key) % table->size];
+  while(*link && strcmp((*link)->key, key))
+    link = &(*link)->next;
+  return link;
+}
+
+static void grow(t_hash_table *table) {
+  size_t i, size = table->size * 2;
+  t_hash_node **buckets = (t_hash_node**) calloc(size, sizeof(t_hash_node*));
+  if(!buckets)
+    return;
+  for(i = 0; i < table->size; i++) {
+    t_hash_node *node = table->buckets[i], *next;
+    for(; node; node = next) {
+      next = node->next;
+      t_hash_node **bucket = &buckets[hash_key(node->key) % size];
+      node->next = *bucket;
+      *bucket = node;
+    }
+  }
+  free(table->buckets);
+  table->buckets = buckets;
+  table->size = size;
+}
+
+t_hash_table * new_hash_table(size_t size) {
+  t_hash_table *table = (t_hash_table*) malloc(sizeof(t_hash_table));
+  table->size = size ? size : 1;
+  table->count = 0;
+  table->buckets = (t_hash_node**) calloc(table->size, sizeof(t_hash_node*));
+  return table;
+}
+
+void free_hash_table(t_hash_table *table) {
+  size_t i;
+  if(!table)
+    return;
+  for(i = 0; i < table->size; i++) {
+    t_hash_node *node = table->buckets[i], *next;
+    for(; node; node = next) {
+      next = node->next;
+      free(node);
+    }
+  }
+  free(table->buckets);
+  free(table);
+}
+
+void * hash_get(t_hash_table *table, const char *key) {
+  t_hash_node *node = *find_node(table, key);
+  return node ? node->value : NULL;
+}
+
+/* Maps key to value, replacing whatever it mapped to before. */
+void hash_put(t_hash_table *table, const char *key, void *value) {
+  t_hash_node **link = find_node(table, key);
+  if(*link) {
+    (*link)->key = key;
+    (*link)->value = value;
+    return;
+  }
+  t_hash_node *node = (t_hash_node*) malloc(sizeof(t_hash_node));
+  node->key = key;
+  node->value = value;
+  node->next = NULL;
+  *link = node;
+  if(++table->count > table->size)
+    grow(table);
+}
+
+/* Removes key, returning the value it mapped to. */
+void * hash_remove(t_hash_table *table, const char *key) {
+  t_hash_node **link = find_node(table, key), *node = *link;
+  if(!node)
+    return NULL;
+  void *value = node->value;
+  *link = node->next;
+  free(node);
+  table->count--;
+  return value;
+}
@@ -0,0 +1,28 @@
+#include <stdlib.h>
+
+#ifndef HASHTABLE_GUARD
+#define HASHTABLE_GUARD
+
+  typedef struct hash_node {
+    const char *key;
+    void *value;
+    struct hash_node *next;
+  } t_hash_node;
+
+  /* Chained hash table from strings to pointers, doubled whenever it
+     holds more entries than buckets. Keys are not copied: each must stay
+     valid while its entry is in the table, which it does when it points
+     into the value it maps to. */
+  typedef struct hash_table {
+    t_hash_node **buckets;
+    size_t size;
+    size_t count;
+  } t_hash_table;
+
+  t_hash_table * new_hash_table(size_t size);
+  void free_hash_table(t_hash_table *table);
+  void * hash_get(t_hash_table *table, const char *key);
+  void hash_put(t_hash_table *table, const char *key, void *value);
+  void * hash_remove(t_hash_table *table, const char *key);
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include "readahead.h"
+
+typedef struct readahead_job {
+  void *owner;
+  char *path;
+  int index;
+  struct readahead_job *next;
+} t_readahead_job;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static t_readahead_job *head = NULL, *tail = NULL;
+static void *active[READAHEAD_MAX_THREADS];
+static pthread_t workers[READAHEAD_MAX_THREADS];
+static int (*fetch_fn)(void *owner, const char *path, int index);
+static int worker_count = 0;
+static int queue_limit = 0;
+static int queued = 0;
+static int stopping = 0;
+static size_t requests = 0;
+static size_t dropped = 0;
+static size_t fetched = 0;
+static size_t failed = 0;
+static size_t hits = 0;
+static size_t wasted_bytes = 0;
+
+static void free_job(t_readahead_job *job) {
+  free(job->path);
+  free(job);
+}
+
+static void *fetch_jobs(void *arg) {
+  int slot = (int)(size_t)arg;
+  pthread_mutex_lock(&queue_lock);
+  while(1) {
+    while(!head && !stopping)
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    if(!head)
+      break;
+    t_readahead_job *job = head;
+    if(!(head = job->next))
+      tail = NULL;
+    queued--;
+    active[slot] = job->owner;
+    pthread_mutex_unlock(&queue_lock);
+
+    int ok = fetch_fn(job->owner, job->path, job->index);
+
+    pthread_mutex_lock(&queue_lock);
+    active[slot] = NULL;
+    if(ok)
+      fetched++;
+    else
+      failed++;
+    pthread_cond_broadcast(&done_cond);
+    free_job(job);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return NULL;
+}
+
+/* Starts the workers. Like writeback_init(), called from the FUSE init
+   callback so that the threads outlive daemonizing. */
+void readahead_init(int (*fetch)(void *owner, const char *path, int index)) {
+  int i, count = READAHEAD < READAHEAD_MAX_THREADS ? READAHEAD : READAHEAD_MAX_THREADS;
+  fetch_fn = fetch;
+  queue_limit = READAHEAD * 4;
+  for(i = worker_count; i < count; i++) {
+    if(pthread_create(&workers[i], NULL, fetch_jobs, (void*)(size_t)i))
+      break;
+    worker_count++;
+  }
+}
+
+int readahead_request(void *owner, const char *path, int index) {
+  pthread_mutex_lock(&queue_lock);
+  if(!worker_count || stopping || queued >= queue_limit) {
+    dropped++;
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+  }
+  t_readahead_job *job = (t_readahead_job*) malloc(sizeof(t_readahead_job));
+  job->owner = owner;
+  job->path = strdup(path);
+  job->index = index;
+  job->next = NULL;
+  if(tail)
+    tail->next = job;
+  else
+    head = job;
+  tail = job;
+  queued++;
+  requests++;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  return 1;
+}
+
+static int owner_active(void *owner) {
+  int i;
+  for(i = 0; i < worker_count; i++)
+    if(active[i] == owner)
+      return 1;
+  return 0;
+}
+
+/* Forgets the requests queued for owner and waits for the ones being
+   fetched, so that the owner can be freed afterwards. */
+void readahead_cancel(void *owner) {
+  t_readahead_job **link, *job;
+  pthread_mutex_lock(&queue_lock);
+  tail = NULL;
+  for(link = &head; (job = *link); ) {
+    if(job->owner == owner) {
+      *link = job->next;
+      queued--;
+      free_job(job);
+    }
+    else {
+      tail = job;
+      link = &job->next;
+    }
+  }
+  while(owner_active(owner))
+    pthread_cond_wait(&done_cond, &queue_lock);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/* Counts a chunk that was fetched ahead and then used. */
+void readahead_hit() {
+  __atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+}
+
+/* Counts bytes that were fetched ahead and never used. */
+void readahead_wasted(size_t bytes) {
+  __atomic_add_fetch(&wasted_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Drops whatever is still queued and stops the workers. */
+void readahead_drain() {
+  int i;
+  pthread_mutex_lock(&queue_lock);
+  stopping = 1;
+  while(head) {
+    t_readahead_job *job = head;
+    head = job->next;
+    free_job(job);
+  }
+  tail = NULL;
+  queued = 0;
+  pthread_cond_broadcast(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  for(i = 0; i < worker_count; i++)
+    pthread_join(workers[i], NULL);
+  worker_count = 0;
+}
+
+int readahead_stats(char *out, size_t size) {
+  pthread_mutex_lock(&queue_lock);
+  int len = snprintf(out, size,
+                     "readahead_requests=%zu\n"
+                     "readahead_dropped=%zu\n"
+                     "readahead_fetched=%zu\n"
+                     "readahead_failed=%zu\n"
+                     "readahead_hits=%zu\n"
+                     "readahead_wasted_bytes=%zu\n",
+                     requests, dropped, fetched, failed,
+                     __atomic_load_n(&hits, __ATOMIC_RELAXED),
+                     __atomic_load_n(&wasted_bytes, __ATOMIC_RELAXED));
+  pthread_mutex_unlock(&queue_lock);
+  return len;
+}
@@ -0,0 +1,27 @@
+#include <stdlib.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#ifndef READAHEAD_GUARD
+#define READAHEAD_GUARD
+
+  #define READAHEAD_MAX_THREADS 16
+
+  int READAHEAD;
+
+  /* Background fetches of chunks a sequential reader is expected to ask
+     for next. Requests name an owner, the handle they are made for, and
+     are carried out by a small pool of workers calling the fetch function
+     given to readahead_init(); it returns nonzero if the chunk was
+     fetched. When more are waiting than the workers can keep up with,
+     new requests are dropped rather than queued, and readahead_request()
+     returns 0. */
+  void readahead_init(int (*fetch)(void *owner, const char *path, int index));
+  int readahead_request(void *owner, const char *path, int index);
+  void readahead_cancel(void *owner);
+  void readahead_hit();
+  void readahead_wasted(size_t bytes);
+  void readahead_drain();
+  int readahead_stats(char *out, size_t size);
+
+#endif
@@ -0,0 +1,640 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include "writeback.h"
+#include "cloudfsapi.h"
+
+#define WRITEBACK_RETRIES 3
+#define JOURNAL_MAGIC "cloudfuse-journal 1"
+
+typedef struct writeback_job {
+  char *path;
+  FILE *fp;
+  off_t size;
+  unsigned char *dirty;
+  int blocks;
+  int attempts;
+  unsigned long seq;
+  struct writeback_job *next;
+} t_writeback_job;
+
+/* A path whose upload failed for good, with the chunks that the failed
+   upload and the ones queued behind it did not store (all of them if
+   any of those uploads sent the whole file). Until an upload that sends
+   all of these chunks succeeds, no other upload of the path is let
+   through, since the manifest it finalizes would point at missing or
+   stale chunks. With a spool directory the failed uploads are held in
+   the journal, to be replayed in order by the next mount unless a
+   complete upload supersedes them first. */
+typedef struct failed_path {
+  char *path;
+  unsigned char *dirty;
+  int blocks;
+  int all;
+  unsigned long *held;
+  int held_count;
+  struct failed_path *next;
+} t_failed_path;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static t_writeback_job *head = NULL, *tail = NULL;
+static t_writeback_job *active = NULL;
+static t_failed_path *failures = NULL;
+static void (*failed_fn)(const char *path, const unsigned char *dirty, int blocks);
+static pthread_t uploader;
+static int running = 0;
+static int stopping = 0;
+static unsigned long next_seq = 1;
+static size_t outstanding = 0;
+static size_t jobs_queued = 0;
+static size_t jobs_done = 0;
+static size_t jobs_failed = 0;
+static size_t jobs_replayed = 0;
+static size_t flush_waits = 0;
+
+/*
+ * Journal: each queued upload is a pair of files in SPOOL_DIR, <seq>.data
+ * holding the snapshot and <seq>.job describing it. The .job file is only
+ * renamed into place once both are on disk, and removed before the data
+ * once the upload succeeds, so any .job found at mount time names a
+ * complete snapshot whose upload may not have finished.
+ */
+
+static void spool_name(char *name, unsigned long seq, const char *ext) {
+  snprintf(name, MAX_PATH_SIZE, "%s/%lu.%s", SPOOL_DIR, seq, ext);
+}
+
+static int sync_spool_dir() {
+  int fd = open(SPOOL_DIR, O_RDONLY);
+  if(fd < 0)
+    return 0;
+  int ok = !fsync(fd);
+  close(fd);
+  return ok;
+}
+
+static int write_journal(t_writeback_job *job, const char *state) {
+  char name[MAX_PATH_SIZE], tmp_name[MAX_PATH_SIZE];
+  int i, nbytes = (job->blocks + 7) / 8;
+  spool_name(name, job->seq, "job");
+  spool_name(tmp_name, job->seq, "tmp");
+  FILE *fp = fopen(tmp_name, "w");
+  if(!fp)
+    return 0;
+  fprintf(fp, JOURNAL_MAGIC "\nstate %s\nsize %lld\nblocks %d\ndirty ",
+          state, (long long)job->size, job->blocks);
+  if(job->dirty)
+    for(i = 0; i < nbytes; i++)
+      fprintf(fp, "%02x", job->dirty[i]);
+  else
+    fprintf(fp, "all");
+  fprintf(fp, "\npath %s", job->path);
+  int ok = !fflush(fp) && !fsync(fileno(fp));
+  ok = !fclose(fp) && ok;
+  if(ok)
+    ok = !rename(tmp_name, name) && sync_spool_dir();
+  if(!ok)
+    unlink(tmp_name);
+  return ok;
+}
+
+static void remove_journal(unsigned long seq) {
+  char name[MAX_PATH_SIZE];
+  spool_name(name, seq, "job");
+  unlink(name);
+  spool_name(name, seq, "data");
+  unlink(name);
+}
+
+static FILE * spool_file(unsigned long seq) {
+  char name[MAX_PATH_SIZE];
+  if(!SPOOL_DIR)
+    return tmpfile();
+  spool_name(name, seq, "data");
+  int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if(fd < 0)
+    return NULL;
+  return fdopen(fd, "w+");
+}
+
+/* Copies the chunks flagged in dirty (all of them if dirty is NULL) into
+   a sparse spool file of the same size. The upload only ever reads those
+   chunks, so the rest of the file never has to be copied. */
+static FILE * snapshot(unsigned long seq, int fd, off_t size,
+                       const unsigned char *dirty, int blocks) {
+  FILE *fp = spool_file(seq);
+  char *buf = get_buffer(CHUNK);
+  int i, ok = fp && buf;
+
+  for(i = 0; ok && i < blocks; i++) {
+    if(dirty && !CHUNK_DIRTY(dirty, i))
+      continue;
+    off_t begin = (off_t)i * CHUNK;
+    size_t length = (size - begin < CHUNK ? size - begin : CHUNK);
+    ok = pread(fd, buf, length, begin) == (ssize_t)length &&
+         pwrite(fileno(fp), buf, length, begin) == (ssize_t)length;
+  }
+  if(ok)
+    ok = !ftruncate(fileno(fp), size);
+  if(ok && SPOOL_DIR)
+    ok = !fsync(fileno(fp));
+  put_buffer(buf);
+  if(!ok && fp) {
+    fclose(fp);
+    if(SPOOL_DIR)
+      remove_journal(seq);
+    fp = NULL;
+  }
+  return fp;
+}
+
+/* Frees the job, dropping its journal entry unless it still has to be
+   retried on the next mount. */
+static void free_job(t_writeback_job *job, int keep_journal) {
+  fclose(job->fp);
+  if(SPOOL_DIR && !keep_journal)
+    remove_journal(job->seq);
+  free(job->path);
+  free(job->dirty);
+  free(job);
+}
+
+static void append_job(t_writeback_job *job) {
+  job->next = NULL;
+  if(tail)
+    tail->next = job;
+  else
+    head = job;
+  tail = job;
+}
+
+static t_writeback_job * queued_job(const char *path) {
+  t_writeback_job *job;
+  for(job = head; job; job = job->next)
+    if(!strcmp(job->path, path))
+      return job;
+  return NULL;
+}
+
+static t_failed_path * find_failure(const char *path) {
+  t_failed_path *failed;
+  for(failed = failures; failed; failed = failed->next)
+    if(!strcmp(failed->path, path))
+      return failed;
+  return NULL;
+}
+
+/* Adds the chunks of job to the failure of its path, holding its
+   journal entry if it has one. */
+static t_failed_path * record_failure(t_writeback_job *job) {
+  t_failed_path *failed = find_failure(job->path);
+  int i;
+  if(!failed) {
+    failed = (t_failed_path*) calloc(1, sizeof(t_failed_path));
+    failed->path = strdup(job->path);
+    failed->next = failures;
+    failures = failed;
+  }
+  if(!job->dirty)
+    failed->all = 1;
+  else {
+    if(job->blocks > failed->blocks) {
+      int bytes = (failed->blocks + 7) / 8;
+      failed->dirty = (unsigned char*) realloc(failed->dirty, (job->blocks + 7) / 8 + 1);
+      memset(failed->dirty + bytes, 0, (job->blocks + 7) / 8 + 1 - bytes);
+      failed->blocks = job->blocks;
+    }
+    for(i = 0; i < job->blocks; i++)
+      if(CHUNK_DIRTY(job->dirty, i))
+        SET_CHUNK_DIRTY(failed->dirty, i);
+  }
+  if(SPOOL_DIR) {
+    failed->held = (unsigned long*) realloc(failed->held,
+                       (failed->held_count + 1) * sizeof(unsigned long));
+    failed->held[failed->held_count++] = job->seq;
+  }
+  jobs_failed++;
+  return failed;
+}
+
+/* Whether an upload of the blocks-long file sending the chunks in dirty
+   (all of them if NULL) stores everything the failure left out. Chunks
+   past the end of the file no longer matter. */
+static int covers(t_failed_path *failed, const unsigned char *dirty, int blocks) {
+  int i;
+  if(!failed || !dirty)
+    return 1;
+  for(i = 0; i < blocks; i++)
+    if((failed->all || (i < failed->blocks && CHUNK_DIRTY(failed->dirty, i))) &&
+       !CHUNK_DIRTY(dirty, i))
+      return 0;
+  return 1;
+}
+
+/* Drops the failure of a path along with the uploads it holds. */
+static void clear_failure(const char *path) {
+  t_failed_path **link, *failed;
+  int i;
+  for(link = &failures; *link && strcmp((*link)->path, path); link = &(*link)->next);
+  if(!(failed = *link))
+    return;
+  *link = failed->next;
+  for(i = 0; i < failed->held_count; i++)
+    remove_journal(failed->held[i]);
+  free(failed->held);
+  free(failed->dirty);
+  free(failed->path);
+  free(failed);
+}
+
+/* Later snapshots of a path only hold the chunks changed since the one
+   before, so a failed upload is retried ahead of everything else with
+   the same chunks. Once it runs out of retries the queued uploads of the
+   path are given up too and their chunks recorded in the failure, with
+   their journal entries kept, marked failed. Returns the failure, or
+   NULL if the upload is to be retried. */
+static t_failed_path * upload_failed(t_writeback_job *job) {
+  t_writeback_job **later;
+  t_failed_path *failed;
+  debugf("background upload of %s failed", job->path);
+  if(++job->attempts < WRITEBACK_RETRIES) {
+    job->next = head;
+    head = job;
+    if(!tail)
+      tail = job;
+    return NULL;
+  }
+  failed = record_failure(job);
+  for(later = &head; *later; ) {
+    t_writeback_job *dropped = *later;
+    if(strcmp(dropped->path, job->path)) {
+      later = &dropped->next;
+      continue;
+    }
+    *later = dropped->next;
+    outstanding -= dropped->size;
+    record_failure(dropped);
+    if(SPOOL_DIR)
+      write_journal(dropped, "failed");
+    free_job(dropped, 1);
+  }
+  for(tail = head; tail && tail->next; tail = tail->next);
+  outstanding -= job->size;
+  if(SPOOL_DIR)
+    write_journal(job, "failed");
+  free_job(job, 1);
+  return failed;
+}
+
+/* Tells the open file of path, through failed_fn, which chunks it has
+   to send again. Called with queue_lock held, which is dropped around
+   the call. */
+static void report_failure(t_failed_path *failed) {
+  char *path = strdup(failed->path);
+  int blocks = failed->all ? -1 : failed->blocks;
+  unsigned char *dirty = NULL;
+  if(failed->dirty && !failed->all) {
+    dirty = (unsigned char*) malloc((blocks + 7) / 8 + 1);
+    memcpy(dirty, failed->dirty, (blocks + 7) / 8 + 1);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  if(failed_fn)
+    failed_fn(path, dirty, blocks);
+  free(dirty);
+  free(path);
+  pthread_mutex_lock(&queue_lock);
+}
+
+static void* upload_jobs(void *in) {
+  (void)in;
+  pthread_mutex_lock(&queue_lock);
+  while(1) {
+    while(!head && !stopping)
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    if(!head)
+      break;
+    t_writeback_job *job = head;
+    head = job->next;
+    if(!head)
+      tail = NULL;
+    active = job;
+    pthread_mutex_unlock(&queue_lock);
+
+    int ok = cloudfs_object_read_fp(job->path, job->fp, job->dirty, job->blocks);
+
+    pthread_mutex_lock(&queue_lock);
+    t_failed_path *failed = NULL;
+    if(ok) {
+      jobs_done++;
+      outstanding -= job->size;
+      if(covers(find_failure(job->path), job->dirty, job->blocks))
+        clear_failure(job->path);
+      free_job(job, 0);
+    }
+    else
+      failed = upload_failed(job);
+    active = NULL;
+    if(failed)
+      report_failure(failed);
+    pthread_cond_broadcast(&done_cond);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return NULL;
+}
+
+static int parse_dirty(const char *hex, t_writeback_job *job) {
+  int i, nbytes = (job->blocks + 7) / 8;
+  if(!strcmp(hex, "all"))
+    return 1;
+  if(strlen(hex) != (size_t)nbytes * 2)
+    return 0;
+  job->dirty = (unsigned char*) calloc(nbytes + 1, 1);
+  for(i = 0; i < nbytes; i++) {
+    unsigned int byte;
+    if(sscanf(hex + i * 2, "%2x", &byte) != 1)
+      return 0;
+    job->dirty[i] = byte;
+  }
+  return 1;
+}
+
+/* Reads one "<key> <value>" line of a journal entry; value points into
+   *line, which is reused between calls. */
+static char * journal_field(FILE *fp, const char *key, char **line, size_t *cap) {
+  ssize_t len = getline(line, cap, fp);
+  size_t key_len = strlen(key);
+  if(len <= (ssize_t)key_len || strncmp(*line, key, key_len) || (*line)[key_len] != ' ')
+    return NULL;
+  if((*line)[len - 1] == '\n')
+    (*line)[len - 1] = '\0';
+  return *line + key_len + 1;
+}
+
+static t_writeback_job * read_journal(unsigned long seq) {
+  char name[MAX_PATH_SIZE], path[MAX_PATH_SIZE], *line = NULL, *value;
+  char state[16] = "";
+  size_t cap = 0, path_len = 0;
+  spool_name(name, seq, "job");
+  FILE *fp = fopen(name, "r");
+  if(!fp)
+    return NULL;
+  t_writeback_job *job = (t_writeback_job*) calloc(1, sizeof(t_writeback_job));
+  job->seq = seq;
+  int ok = getline(&line, &cap, fp) > 0 && !strcmp(line, JOURNAL_MAGIC "\n");
+  if(ok && (ok = (value = journal_field(fp, "state", &line, &cap)) != NULL))
+    snprintf(state, sizeof(state), "%s", value);
+  if(ok && (ok = (value = journal_field(fp, "size", &line, &cap)) != NULL))
+    job->size = strtoll(value, NULL, 10);
+  if(ok && (ok = (value = journal_field(fp, "blocks", &line, &cap)) != NULL))
+    job->blocks = atoi(value);
+  if(ok && (ok = (value = journal_field(fp, "dirty", &line, &cap)) != NULL))
+    ok = parse_dirty(value, job);
+  if(ok && (ok = fread(path, 1, 5, fp) == 5 && !memcmp(path, "path ", 5)))
+    ok = (path_len = fread(path, 1, sizeof(path) - 1, fp)) > 0;
+  free(line);
+  fclose(fp);
+  if(ok) {
+    path[path_len] = '\0';
+    job->path = strdup(path);
+    spool_name(name, seq, "data");
+    int fd = open(name, O_RDWR);
+    ok = fd >= 0 && (job->fp = fdopen(fd, "r+")) &&
+         cloudfs_file_size(fd) == job->size;
+    if(!job->fp && fd >= 0)
+      close(fd);
+  }
+  if(!ok) {
+    debugf("discarding unreadable journal entry %lu", seq);
+    if(job->fp)
+      fclose(job->fp);
+    free(job->path);
+    free(job->dirty);
+    free(job);
+    remove_journal(seq);
+    return NULL;
+  }
+  debugf("replaying %s upload of %s", state, job->path);
+  return job;
+}
+
+static int compare_seq(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Queues the journal entries left by the previous mount, oldest first,
+   and clears out snapshots that never got an entry. */
+static void replay_journal() {
+  DIR *dir = opendir(SPOOL_DIR);
+  struct dirent *de;
+  unsigned long *seqs = NULL;
+  int count = 0, i;
+  if(!dir) {
+    debugf("unable to open spool directory %s", SPOOL_DIR);
+    return;
+  }
+  while((de = readdir(dir))) {
+    unsigned long seq;
+    char ext[8], name[MAX_PATH_SIZE];
+    if(sscanf(de->d_name, "%lu.%7s", &seq, ext) != 2)
+      continue;
+    if(seq >= next_seq)
+      next_seq = seq + 1;
+    if(!strcmp(ext, "job")) {
+      seqs = (unsigned long*) realloc(seqs, (count + 1) * sizeof(unsigned long));
+      seqs[count++] = seq;
+    }
+    else if(!strcmp(ext, "tmp")) {
+      snprintf(name, sizeof(name), "%s/%s", SPOOL_DIR, de->d_name);
+      unlink(name);
+    }
+  }
+  closedir(dir);
+  qsort(seqs, count, sizeof(unsigned long), compare_seq);
+
+  dir = opendir(SPOOL_DIR);
+  while(dir && (de = readdir(dir))) {
+    unsigned long seq;
+    char ext[8], name[MAX_PATH_SIZE];
+    if(sscanf(de->d_name, "%lu.%7s", &seq, ext) != 2 || strcmp(ext, "data") ||
+       bsearch(&seq, seqs, count, sizeof(unsigned long), compare_seq))
+      continue;
+    snprintf(name, sizeof(name), "%s/%s", SPOOL_DIR, de->d_name);
+    unlink(name);
+  }
+  if(dir)
+    closedir(dir);
+
+  for(i = 0; i < count; i++) {
+    t_writeback_job *job = read_journal(seqs[i]);
+    if(!job)
+      continue;
+    if(write_journal(job, "queued")) {
+      outstanding += job->size;
+      jobs_replayed++;
+      append_job(job);
+    }
+    else
+      free_job(job, 1);
+  }
+  free(seqs);
+}
+
+/* Starts the uploader. Called from the FUSE init callback rather than
+   main(), as threads started before FUSE daemonizes would not survive
+   the fork. Uploads replayed from the journal are sent even when
+   write-back is off. failed is called with the chunks a path has to
+   send again whenever one of its uploads fails for good; blocks is -1
+   if that is all of them. */
+void writeback_init(void (*failed)(const char *path, const unsigned char *dirty, int blocks)) {
+  failed_fn = failed;
+  pthread_mutex_lock(&queue_lock);
+  if(SPOOL_DIR)
+    replay_journal();
+  pthread_mutex_unlock(&queue_lock);
+  if((WRITEBACK || head) && !running)
+    running = !pthread_create(&uploader, NULL, upload_jobs, NULL);
+}
+
+/* Queues an upload of the blocks-long file in fd, sending only the chunks
+   flagged in dirty. On success the job owns dirty. Returns 0 if the
+   snapshot or its journal entry could not be written, or if an earlier
+   upload of path failed and this one does not send the chunks it left
+   out, in which case nothing is queued. */
+int writeback_enqueue(const char *path, int fd, off_t size,
+                      unsigned char *dirty, int blocks) {
+  pthread_mutex_lock(&queue_lock);
+  if(!covers(find_failure(path), dirty, blocks)) {
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+  }
+  unsigned long seq = next_seq++;
+  pthread_mutex_unlock(&queue_lock);
+
+  FILE *fp = snapshot(seq, fd, size, dirty, blocks);
+  if(!fp)
+    return 0;
+  t_writeback_job *job = (t_writeback_job*) calloc(1, sizeof(t_writeback_job));
+  job->path = strdup(path);
+  job->fp = fp;
+  job->size = size;
+  job->dirty = dirty;
+  job->blocks = blocks;
+  job->seq = seq;
+  if(SPOOL_DIR && !write_journal(job, "queued")) {
+    job->dirty = NULL;
+    free_job(job, 0);
+    return 0;
+  }
+
+  pthread_mutex_lock(&queue_lock);
+  if(outstanding && outstanding + size > WRITEBACK_BYTES)
+    flush_waits++;
+  while(outstanding && outstanding + size > WRITEBACK_BYTES)
+    pthread_cond_wait(&done_cond, &queue_lock);
+  /* an earlier upload of the path may have failed for good meanwhile */
+  if(!covers(find_failure(path), dirty, blocks)) {
+    pthread_mutex_unlock(&queue_lock);
+    job->dirty = NULL;
+    free_job(job, 0);
+    return 0;
+  }
+  outstanding += size;
+  jobs_queued++;
+  append_job(job);
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  return 1;
+}
+
+/* Blocks until nothing is queued or uploading for path. Returns 0 while
+   an upload of path has failed and no complete one has succeeded since. */
+int writeback_wait(const char *path) {
+  pthread_mutex_lock(&queue_lock);
+  while(queued_job(path) || (active && !strcmp(active->path, path)))
+    pthread_cond_wait(&done_cond, &queue_lock);
+  int ok = !find_failure(path);
+  pthread_mutex_unlock(&queue_lock);
+  return ok;
+}
+
+/* Whether nothing is queued or uploading for path and no upload of it
+   has failed, so that chunks stored outside the queue cannot be
+   overwritten by an older queued snapshot. Does not block. */
+int writeback_idle(const char *path) {
+  pthread_mutex_lock(&queue_lock);
+  int idle = !queued_job(path) && !(active && !strcmp(active->path, path)) &&
+             !find_failure(path);
+  pthread_mutex_unlock(&queue_lock);
+  return idle;
+}
+
+/* Whether an upload of path sending the chunks in dirty may go ahead,
+   which it may not if it would finalize an object missing chunks that a
+   failed upload did not store. */
+int writeback_covers(const char *path, const unsigned char *dirty, int blocks) {
+  pthread_mutex_lock(&queue_lock);
+  int ok = covers(find_failure(path), dirty, blocks);
+  pthread_mutex_unlock(&queue_lock);
+  return ok;
+}
+
+/* Called after an upload of path made outside the queue succeeds. */
+void writeback_stored(const char *path, const unsigned char *dirty, int blocks) {
+  pthread_mutex_lock(&queue_lock);
+  if(covers(find_failure(path), dirty, blocks))
+    clear_failure(path);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/* Forgets a failure of path once the object has been removed or
+   replaced, along with the failed uploads held for the next mount. */
+void writeback_forget(const char *path) {
+  pthread_mutex_lock(&queue_lock);
+  clear_failure(path);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/* Calls fn for every pending upload, oldest first, with the size the
+   object will have once it lands. */
+void writeback_foreach(void (*fn)(const char *path, off_t size, void *data),
+                       void *data) {
+  t_writeback_job *job;
+  pthread_mutex_lock(&queue_lock);
+  if(active)
+    fn(active->path, active->size, data);
+  for(job = head; job; job = job->next)
+    fn(job->path, job->size, data);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+/* Uploads everything still queued and stops the uploader. */
+void writeback_drain() {
+  if(!running)
+    return;
+  pthread_mutex_lock(&queue_lock);
+  stopping = 1;
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_lock);
+  pthread_join(uploader, NULL);
+  running = 0;
+}
+
+int writeback_stats(char *out, size_t size) {
+  pthread_mutex_lock(&queue_lock);
+  int len = snprintf(out, size,
+                     "writeback_outstanding_bytes=%zu\n"
+                     "writeback_jobs_queued=%zu\n"
+                     "writeback_jobs_done=%zu\n"
+                     "writeback_jobs_failed=%zu\n"
+                     "writeback_jobs_replayed=%zu\n"
+                     "writeback_flush_waits=%zu\n",
+                     outstanding, jobs_queued, jobs_done, jobs_failed,
+                     jobs_replayed, flush_waits);
+  pthread_mutex_unlock(&queue_lock);
+  return len;
+}
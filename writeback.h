@@ -0,0 +1,39 @@
+#include <stdlib.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#ifndef WRITEBACK_GUARD
+#define WRITEBACK_GUARD
+
+  int WRITEBACK;
+  size_t WRITEBACK_BYTES;
+  char *SPOOL_DIR;
+
+  /* Background uploads for flushed files. A flush snapshots the chunks it
+     has to send and queues them; a single uploader thread works through
+     the queue in order, so successive flushes of one path land in the
+     order they were made. Queued snapshots are limited to WRITEBACK_BYTES
+     of file data, beyond which a flush waits for room.
+
+     When SPOOL_DIR is set, snapshots are kept there together with a
+     journal entry for each queued upload, and entries left behind by a
+     previous mount are queued again by writeback_init().
+
+     An upload that fails for good blocks every later upload of its path
+     that does not send the chunks it left out, and writeback_wait()
+     reports the failure until one that does has been stored. */
+  void writeback_init(void (*failed)(const char *path, const unsigned char *dirty,
+                                     int blocks));
+  int writeback_enqueue(const char *path, int fd, off_t size,
+                        unsigned char *dirty, int blocks);
+  int writeback_wait(const char *path);
+  int writeback_idle(const char *path);
+  int writeback_covers(const char *path, const unsigned char *dirty, int blocks);
+  void writeback_stored(const char *path, const unsigned char *dirty, int blocks);
+  void writeback_forget(const char *path);
+  void writeback_foreach(void (*fn)(const char *path, off_t size, void *data),
+                         void *data);
+  void writeback_drain();
+  int writeback_stats(char *out, size_t size);
+
+#endif
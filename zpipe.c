@@ -12,124 +12,224 @@
                      Avoid some compiler warnings for input and output buffers
  */
 
+#include <stdlib.h>
+#include <pthread.h>
 #include "zpipe.h"
 
-/* Compress from file source to file dest until EOF on source.
-   def() returns Z_OK on success, Z_MEM_ERROR if memory could not be
-   allocated for processing, Z_STREAM_ERROR if an invalid compression
-   level is supplied, Z_VERSION_ERROR if the version of zlib.h and the
-   version of the library linked do not match, or Z_ERRNO if there is
-   an error reading or writing the files. */
-int def(FILE *source, FILE *dest, int level)
+/* Each thread keeps one deflate and one inflate stream for its whole
+   life. Allocating and zeroing the zlib state costs more than
+   compressing a small chunk, so streams are reset between uses instead
+   of being torn down, and deflateParams() switches the level in place. */
+typedef struct zstreams {
+    z_stream deflate;
+    z_stream inflate;
+    int deflate_ready;
+    int inflate_ready;
+    int level;
+} t_zstreams;
+
+static pthread_key_t zstreams_key;
+static pthread_once_t zstreams_once = PTHREAD_ONCE_INIT;
+
+static void free_zstreams(void *data)
 {
-    int ret, flush;
-    unsigned have;
-    z_stream strm;
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
-
-    /* allocate deflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = deflateInit(&strm, level);
-    if (ret != Z_OK)
-        return ret;
+    t_zstreams *streams = data;
+
+    if (streams->deflate_ready)
+        (void)deflateEnd(&streams->deflate);
+    if (streams->inflate_ready)
+        (void)inflateEnd(&streams->inflate);
+    free(streams);
+}
+
+static void create_zstreams_key(void)
+{
+    pthread_key_create(&zstreams_key, free_zstreams);
+}
+
+static t_zstreams *thread_zstreams(void)
+{
+    t_zstreams *streams;
 
-    /* compress until end of file */
-    do {
-        strm.avail_in = fread(in, 1, CHUNK, source);
-        if (ferror(source)) {
-            (void)deflateEnd(&strm);
-            return Z_ERRNO;
+    pthread_once(&zstreams_once, create_zstreams_key);
+    streams = pthread_getspecific(zstreams_key);
+    if (streams == NULL) {
+        streams = calloc(1, sizeof(t_zstreams));
+        if (streams != NULL && pthread_setspecific(zstreams_key, streams)) {
+            free(streams);
+            streams = NULL;
         }
-        flush = feof(source) ? Z_FINISH : Z_NO_FLUSH;
-        strm.next_in = in;
-
-        /* run deflate() on input until output buffer not full, finish
-           compression if all of source has been read in */
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out;
-            ret = deflate(&strm, flush);    /* no bad return value */
-            assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            have = CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)deflateEnd(&strm);
-                return Z_ERRNO;
-            }
-        } while (strm.avail_out == 0);
-        assert(strm.avail_in == 0);     /* all input will be used */
-
-        /* done when last data in file processed */
-    } while (flush != Z_FINISH);
-    assert(ret == Z_STREAM_END);        /* stream will be complete */
-
-    /* clean up and return */
-    (void)deflateEnd(&strm);
+    }
+    return streams;
+}
+
+/* Returns this thread's deflate stream, reset and set to level. */
+static int get_deflate(z_stream **strm, int level)
+{
+    int ret;
+    t_zstreams *streams = thread_zstreams();
+
+    if (streams == NULL)
+        return Z_MEM_ERROR;
+    *strm = &streams->deflate;
+    if (streams->deflate_ready && level == streams->level)
+        return deflateReset(&streams->deflate);
+    /* deflateParams() after deflateReset() flushes into the previous
+       stream's stale output pointers on zlib before 1.2.12, so a new
+       level gets a new stream instead */
+    if (streams->deflate_ready) {
+        deflateEnd(&streams->deflate);
+        streams->deflate_ready = 0;
+    }
+    streams->deflate.zalloc = Z_NULL;
+    streams->deflate.zfree = Z_NULL;
+    streams->deflate.opaque = Z_NULL;
+    ret = deflateInit(&streams->deflate, level);
+    if (ret != Z_OK)
+        return ret;
+    streams->deflate_ready = 1;
+    streams->level = level;
     return Z_OK;
 }
 
-/* Decompress from file source to file dest until stream ends or EOF.
-   inf() returns Z_OK on success, Z_MEM_ERROR if memory could not be
-   allocated for processing, Z_DATA_ERROR if the deflate data is
-   invalid or incomplete, Z_VERSION_ERROR if the version of zlib.h and
-   the version of the library linked do not match, or Z_ERRNO if there
-   is an error reading or writing the files. */
-int inf(FILE *source, FILE *dest)
+/* Returns this thread's inflate stream, reset for a new zlib stream. */
+static int get_inflate(z_stream **strm)
 {
     int ret;
-    unsigned have;
-    z_stream strm;
-    unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
-
-    /* allocate inflate state */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-    ret = inflateInit(&strm);
+    t_zstreams *streams = thread_zstreams();
+
+    if (streams == NULL)
+        return Z_MEM_ERROR;
+    *strm = &streams->inflate;
+    if (!streams->inflate_ready) {
+        streams->inflate.zalloc = Z_NULL;
+        streams->inflate.zfree = Z_NULL;
+        streams->inflate.opaque = Z_NULL;
+        streams->inflate.avail_in = 0;
+        streams->inflate.next_in = Z_NULL;
+        ret = inflateInit(&streams->inflate);
+        if (ret != Z_OK)
+            return ret;
+        streams->inflate_ready = 1;
+        return Z_OK;
+    }
+    return inflateReset(&streams->inflate);
+}
+
+/* Compress source_len bytes from source into dest in a single call.
+   *dest_len holds the capacity of dest on entry and the compressed size
+   on return. def_buf() returns Z_OK on success, Z_BUF_ERROR if dest is
+   too small to hold the whole stream, or the error from deflateInit().
+   A capacity of def_bound(source_len) is always large enough. */
+int def_buf(const unsigned char *source, size_t source_len,
+            unsigned char *dest, size_t *dest_len, int level)
+{
+    int ret;
+    z_stream *strm;
+
+    ret = get_deflate(&strm, level);
     if (ret != Z_OK)
         return ret;
 
-    /* decompress until deflate stream ends or end of file */
-    do {
-        strm.avail_in = fread(in, 1, CHUNK, source);
-        if (ferror(source)) {
-            (void)inflateEnd(&strm);
-            return Z_ERRNO;
-        }
-        if (strm.avail_in == 0)
-            break;
-        strm.next_in = in;
-
-        /* run inflate() on input until output buffer not full */
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out;
-            ret = inflate(&strm, Z_NO_FLUSH);
-            assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-            switch (ret) {
-            case Z_NEED_DICT:
-                ret = Z_DATA_ERROR;     /* and fall through */
-            case Z_DATA_ERROR:
-            case Z_MEM_ERROR:
-                (void)inflateEnd(&strm);
-                return ret;
-            }
-            have = CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)inflateEnd(&strm);
-                return Z_ERRNO;
-            }
-        } while (strm.avail_out == 0);
-
-        /* done when inflate() says it's done */
-    } while (ret != Z_STREAM_END);
-
-    /* clean up and return */
-    (void)inflateEnd(&strm);
-    return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
-}
\ No newline at end of file
+    strm->next_in = (unsigned char *)source;
+    strm->avail_in = source_len;
+    strm->next_out = dest;
+    strm->avail_out = *dest_len;
+    ret = deflate(strm, Z_FINISH);
+    assert(ret != Z_STREAM_ERROR);      /* state not clobbered */
+    *dest_len -= strm->avail_out;
+
+    return ret == Z_STREAM_END ? Z_OK : Z_BUF_ERROR;
+}
+
+size_t def_bound(size_t source_len)
+{
+    return compressBound(source_len);
+}
+
+/* Decompress the whole zlib stream in source into dest. On entry
+   *dest_len is the capacity of dest, on return the number of bytes
+   written. inf_buf() returns Z_OK on success, Z_BUF_ERROR if dest is
+   too small, Z_DATA_ERROR if the stream is invalid or incomplete, or the
+   error from inflateInit(). */
+int inf_buf(const unsigned char *source, size_t source_len,
+            unsigned char *dest, size_t *dest_len)
+{
+    int ret;
+    z_stream *strm;
+
+    ret = get_inflate(&strm);
+    if (ret != Z_OK)
+        return ret;
+
+    strm->next_in = (unsigned char *)source;
+    strm->avail_in = source_len;
+    strm->next_out = dest;
+    strm->avail_out = *dest_len;
+    ret = inflate(strm, Z_FINISH);
+    assert(ret != Z_STREAM_ERROR);      /* state not clobbered */
+    *dest_len -= strm->avail_out;
+
+    if (ret == Z_STREAM_END)
+        return Z_OK;
+    if (ret == Z_NEED_DICT || (ret == Z_BUF_ERROR && strm->avail_out))
+        return Z_DATA_ERROR;
+    return ret;
+}
+
+/* Prepare strm for an incremental decompression with inf_push(). The
+   stream is owned by the caller rather than taken from the thread, as
+   a download may be fed from several calls. inf_init() returns Z_OK or
+   the error from inflateInit(). */
+int inf_init(z_stream *strm)
+{
+    strm->zalloc = Z_NULL;
+    strm->zfree = Z_NULL;
+    strm->opaque = Z_NULL;
+    strm->avail_in = 0;
+    strm->next_in = Z_NULL;
+    return inflateInit(strm);
+}
+
+/* Decompress as much of source as fits into dest. On entry *source_len
+   is the input available and *dest_len the capacity of dest; on return
+   *source and *source_len have been advanced past the input consumed
+   and *dest_len holds the number of bytes written. Call again with the
+   same input while dest comes back full. inf_push() returns Z_OK if it
+   needs more input or output space, Z_STREAM_END once the stream is
+   complete, Z_DATA_ERROR if the deflate data is invalid, or
+   Z_MEM_ERROR if memory could not be allocated for processing. */
+int inf_push(z_stream *strm, const unsigned char **source, size_t *source_len,
+             unsigned char *dest, size_t *dest_len)
+{
+    int ret;
+
+    strm->next_in = (unsigned char *)*source;
+    strm->avail_in = *source_len;
+    strm->next_out = dest;
+    strm->avail_out = *dest_len;
+    ret = inflate(strm, Z_NO_FLUSH);
+    assert(ret != Z_STREAM_ERROR);      /* state not clobbered */
+    *source += *source_len - strm->avail_in;
+    *source_len = strm->avail_in;
+    *dest_len -= strm->avail_out;
+
+    switch (ret) {
+    case Z_NEED_DICT:
+        return Z_DATA_ERROR;
+    case Z_BUF_ERROR:                   /* no progress possible yet */
+        return Z_OK;
+    }
+    return ret;
+}
+
+/* Prepare strm, already set up by inf_init(), for the next stream. */
+int inf_reset(z_stream *strm)
+{
+    return inflateReset(strm);
+}
+
+void inf_end(z_stream *strm)
+{
+    (void)inflateEnd(strm);
+}
@@ -16,7 +16,15 @@
 
 	int CHUNK;
 
-	int def(FILE *source, FILE *dest, int level);
-	int inf(FILE *source, FILE *dest);
+	int def_buf(const unsigned char *source, size_t source_len,
+	            unsigned char *dest, size_t *dest_len, int level);
+	size_t def_bound(size_t source_len);
+	int inf_buf(const unsigned char *source, size_t source_len,
+	            unsigned char *dest, size_t *dest_len);
+	int inf_init(z_stream *strm);
+	int inf_push(z_stream *strm, const unsigned char **source, size_t *source_len,
+	             unsigned char *dest, size_t *dest_len);
+	int inf_reset(z_stream *strm);
+	void inf_end(z_stream *strm);
 
 #endif
\ No newline at end of file